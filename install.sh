@@ -5,6 +5,7 @@ set -e
 # Define installation paths
 MODULE_NAME="usbguard"
 RULES_FILE="/etc/usbguard.rules"
+RULES_DIR="/etc/usbguard.rules.d"
 KERNEL_MODULE_DIR="/lib/modules/$(uname -r)/extra"
 
 # Ensure script is run as root
@@ -21,6 +22,9 @@ if [[ ! -f "$RULES_FILE" ]]; then
     cp usbguard.rules "$RULES_FILE"
 fi
 
+# Create the drop-in directory for additional rules files
+mkdir -p "$RULES_DIR"
+
 # Build the kernel module
 make clean
 make
@@ -0,0 +1,195 @@
+#!/bin/bash
+#
+# hotplug.sh - plug/unplug load on the usbguard probe path
+#
+# Plugs and unplugs configfs gadgets on dummy_hcd virtual host
+# controllers as fast as the USB core enumerates them, first without the
+# module and then with it loaded and allowing the gadgets. Each job owns
+# one controller and one gadget, and the jobs run in parallel. Every
+# cycle plugs a different device: VID, PID, serial number and device
+# class change from one plug to the next, so the module sees new
+# identities rather than one cached verdict. Prints the achieved plug
+# rate and the plug/unplug latency of both runs, and the probe counters
+# the module kept.
+#
+# Usage: tests/hotplug.sh [-n cycles] [-j jobs] [-m usbguard.ko]
+# Needs root and the dummy_hcd, libcomposite and usb_f_ss_lb modules.
+
+set -e
+
+CYCLES=500      # per job
+JOBS=4
+MODULE="./usbguard.ko"
+# pid.codes and shared test VIDs; with random PIDs nothing binds to them
+VIDS=(1209 16c0 f055)
+# per-interface devices reach usbguard's match table, vendor-class ones do not
+CLASSES=(00 00 00 ff)
+GADGETS="/sys/kernel/config/usb_gadget"
+STATS="/sys/kernel/usbguard/stats"
+TIMEOUT_US=5000000
+
+while getopts "n:j:m:" opt; do
+    case "$opt" in
+        n) CYCLES="$OPTARG" ;;
+        j) JOBS="$OPTARG" ;;
+        m) MODULE="$OPTARG" ;;
+        *) echo "Usage: $0 [-n cycles] [-j jobs] [-m usbguard.ko]" >&2; exit 1 ;;
+    esac
+done
+
+# Ensure script is run as root
+if [[ $EUID -ne 0 ]]; then
+    echo "This script must be run as root." >&2
+    exit 1
+fi
+if [[ -z "$EPOCHREALTIME" ]]; then
+    echo "This script needs bash 5 or later." >&2
+    exit 1
+fi
+if [[ ! -f "$MODULE" ]]; then
+    echo "Module $MODULE not found, build it with make first." >&2
+    exit 1
+fi
+if [[ -d /sys/module/usbguard ]]; then
+    echo "Unload usbguard first: the first run measures without it." >&2
+    exit 1
+fi
+
+LOADED=0
+OUT=$(mktemp -d)
+cleanup() {
+    local g
+    for ((g = 0; g < JOBS; g++)); do
+        gadget_remove "$GADGETS/usbguard_hotplug$g"
+    done
+    rm -rf "$OUT"
+    [[ $LOADED -eq 1 ]] && rmmod usbguard || true
+}
+
+gadget_remove() {
+    local gadget=$1
+    [[ -d "$gadget" ]] || return 0
+    echo "" > "$gadget/UDC" 2>/dev/null || true
+    rm -f "$gadget/configs/c.1/SourceSink.0"
+    rmdir "$gadget/configs/c.1/strings/0x409" "$gadget/configs/c.1" \
+          "$gadget/functions/SourceSink.0" "$gadget/strings/0x409" "$gadget" 2>/dev/null || true
+}
+trap cleanup EXIT
+
+# One controller per job; dummy_hcd only takes the count when it loads
+if [[ -d /sys/module/dummy_hcd ]] && (( $(ls /sys/class/udc | grep -c dummy_udc) < JOBS )); then
+    echo "dummy_hcd is loaded with fewer than $JOBS controllers, rmmod it first." >&2
+    exit 1
+fi
+modprobe dummy_hcd num="$JOBS"
+modprobe libcomposite
+modprobe usb_f_ss_lb
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+# gadget_create JOB: an unbound gadget with a SourceSink interface
+gadget_create() {
+    local gadget="$GADGETS/usbguard_hotplug$1"
+    mkdir -p "$gadget/strings/0x409" "$gadget/configs/c.1/strings/0x409" "$gadget/functions/SourceSink.0"
+    echo "usbguard" > "$gadget/strings/0x409/manufacturer"
+    echo "hotplug test" > "$gadget/strings/0x409/product"
+    echo "ss_lb" > "$gadget/configs/c.1/strings/0x409/configuration"
+    ln -s "$gadget/functions/SourceSink.0" "$gadget/configs/c.1/"
+}
+
+for ((g = 0; g < JOBS; g++)); do
+    if [[ ! -e /sys/class/udc/dummy_udc.$g || ! -d /sys/devices/platform/dummy_hcd.$g ]]; then
+        echo "No dummy_hcd controller $g found." >&2
+        exit 1
+    fi
+    gadget_create "$g"
+done
+
+# Busy-wait until the test [ $1 ] succeeds; prints nothing, fails on timeout
+wait_for() {
+    local start=${EPOCHREALTIME/./}
+    until [ $1 ]; do
+        if (( ${EPOCHREALTIME/./} - start > TIMEOUT_US )); then
+            echo "Timed out waiting for $1" >&2
+            return 1
+        fi
+    done
+}
+
+# job LABEL JOB LOADED: CYCLES plugs of a new identity each on controller JOB
+job() {
+    local label=$1 j=$2 loaded=$3 i t0 t1 t2 class ready
+    local gadget="$GADGETS/usbguard_hotplug$j" udc="dummy_udc.$j"
+    local bus dev
+    bus=$(ls -d /sys/devices/platform/dummy_hcd.$j/usb* | head -n1)
+    # The gadget shows up on port 1 of the controller's root hub
+    dev="/sys/bus/usb/devices/${bus##*usb}-1"
+
+    for ((i = 0; i < CYCLES; i++)); do
+        class=${CLASSES[i % ${#CLASSES[@]}]}
+        echo "0x${VIDS[(i + j) % ${#VIDS[@]}]}" > "$gadget/idVendor"
+        printf '0x%04x\n' $(((j << 12 | i) & 0xffff)) > "$gadget/idProduct"
+        echo "0x$class" > "$gadget/bDeviceClass"
+        echo "UG$label$j-$i" > "$gadget/strings/0x409/serialnumber"
+
+        # usbguard binds the interfaces it accepts; others just appear
+        ready="-e $dev:1.0"
+        [[ $loaded -eq 1 && $class == 00 ]] && ready="-e $dev:1.0/driver"
+
+        t0=${EPOCHREALTIME/./}
+        echo "$udc" > "$gadget/UDC"
+        wait_for "$ready"
+        t1=${EPOCHREALTIME/./}
+        echo "" > "$gadget/UDC"
+        wait_for "! -e $dev"
+        t2=${EPOCHREALTIME/./}
+        echo $((t1 - t0)) >> "$OUT/$label.plug.$j"
+        echo $((t2 - t1)) >> "$OUT/$label.unplug.$j"
+    done
+}
+
+# run LABEL LOADED: all jobs at once, then the achieved rate and latencies
+run() {
+    local label=$1 loaded=$2 j start end rc=0
+    local -a pids
+
+    start=${EPOCHREALTIME/./}
+    for ((j = 0; j < JOBS; j++)); do
+        job "$label" "$j" "$loaded" &
+        pids+=($!)
+    done
+    for j in "${pids[@]}"; do
+        wait "$j" || rc=1
+    done
+    end=${EPOCHREALTIME/./}
+    [[ $rc -eq 0 ]] || { echo "$label: a job failed" >&2; exit 1; }
+
+    report "$label" $((end - start)) plug "$OUT/$label.plug".*
+    report "$label" $((end - start)) unplug "$OUT/$label.unplug".*
+}
+
+# report LABEL WALL_US KIND FILES...: plugs per second over all jobs, latency percentiles
+report() {
+    local label=$1 wall=$2 kind=$3
+    shift 3
+    local -a sorted
+    mapfile -t sorted < <(sort -n "$@")
+    local n=${#sorted[@]}
+
+    printf '%-9s %-7s n=%-7s per_s=%-8s p50_us=%-7s p99_us=%-7s max_us=%s\n' \
+           "$label" "$kind" "$n" $((n * 1000000 / wall)) \
+           "${sorted[n / 2]}" "${sorted[n * 99 / 100]}" "${sorted[n - 1]}"
+}
+
+echo "Running $JOBS jobs of $CYCLES plug/unplug cycles, VIDs ${VIDS[*]}, classes ${CLASSES[*]}..."
+
+run "unloaded" 0
+
+insmod "$MODULE"
+LOADED=1
+for vid in "${VIDS[@]}"; do
+    echo "$vid 0000-ffff"
+done > /sys/kernel/usbguard/rules
+echo 1 > "$STATS"
+run "loaded" 1
+
+grep '^probe' "$STATS" | sed 's/^/loaded    /'
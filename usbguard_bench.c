@@ -0,0 +1,155 @@
+/*
+ * usbguard_bench.c - userspace benchmark of the policy lookup tables
+ *
+ * Builds usbguard_core.c outside the kernel (make usbguard-bench) and
+ * times the same lookups as the in-kernel bench attribute, plus rule
+ * parsing, without loading the module.
+ *
+ * Usage: usbguard-bench [entries...]   (default: 10 100 ... 1000000)
+ */
+#include <stdio.h>
+#include <time.h>
+
+#include "usbguard_core.h"
+
+#define BENCH_MAX_ENTRIES (1 << 20)
+#define BENCH_LOOKUPS (1 << 20)     /* per run */
+#define BENCH_KEYS 4096             /* lookup keys cycled through, half of them hits */
+#define BENCH_SERIAL_LEN 12
+
+struct bench_ctx {
+    struct ruleset rules;
+    struct serial_set serials;
+    u32 keys[BENCH_KEYS];
+    char serial_keys[BENCH_KEYS][BENCH_SERIAL_LEN];
+    char lines[BENCH_KEYS][24];
+};
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_report(const char *name, u32 entries, u64 lookups, u64 ns)
+{
+    u64 ps = ns * 1000 / lookups;
+
+    printf("bench=%s entries=%u cpus=1 lookups=%llu ns_per_lookup=%llu.%03llu\n",
+           name, entries, (unsigned long long)lookups,
+           (unsigned long long)(ps / 1000), (unsigned long long)(ps % 1000));
+}
+
+/* Same table layout as the module's bench_fill(): n unmergeable single-PID ranges, n serials */
+static int bench_fill(struct bench_ctx *ctx, u32 n)
+{
+    struct ruleset *set = &ctx->rules;
+    char serial[BENCH_SERIAL_LEN];
+    u32 i;
+    int rc;
+
+    set->ranges = kvmalloc_array(n, sizeof(*set->ranges), GFP_KERNEL);
+    set->hits = kvcalloc(n, sizeof(*set->hits), GFP_KERNEL);
+    if (!set->ranges || !set->hits) return -ENOMEM;
+    for (i = 0; i < n; i++) {
+        u32 key = (0x1000 + (i >> 15)) << 16 | (i & 0x7FFF) * 2;
+
+        set->ranges[i].lo = set->ranges[i].hi = key;
+    }
+    set->count = set->cap = n;
+
+    for (i = 0; i < n; i++) {
+        snprintf(serial, sizeof(serial), "SN%08x", i);
+        rc = serial_set_add(&ctx->serials, serial, strlen(serial));
+        if (rc) return rc;
+    }
+
+    for (i = 0; i < BENCH_KEYS; i++) {
+        u32 e = (u32)random() % n;
+        bool hit = i & 1;
+
+        ctx->keys[i] = (0x1000 + (e >> 15)) << 16 | ((e & 0x7FFF) * 2 + !hit);
+        snprintf(ctx->serial_keys[i], BENCH_SERIAL_LEN, "%cN%08x", hit ? 'S' : 'X', e);
+        snprintf(ctx->lines[i], sizeof(ctx->lines[i]), "%04x %04x-%04x\n",
+                 0x1000 + (e >> 15), e & 0x7FFF, (e & 0x7FFF) + 1);
+    }
+    return 0;
+}
+
+static void bench_free(struct bench_ctx *ctx)
+{
+    ruleset_free(&ctx->rules);
+    serial_set_free(&ctx->serials);
+    free(ctx);
+}
+
+static int bench_entries(u32 n)
+{
+    struct bench_ctx *ctx;
+    volatile unsigned long found = 0;
+    struct vidpid rule;
+    char line[24];
+    u64 start;
+    u32 i;
+    int rc;
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) return -ENOMEM;
+    rc = bench_fill(ctx, n);
+    if (rc) goto out;
+
+    start = now_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        found += ruleset_match(&ctx->rules, ctx->keys[i & (BENCH_KEYS - 1)]);
+    bench_report("ruleset_match", n, BENCH_LOOKUPS, now_ns() - start);
+
+    start = now_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        const char *s = ctx->serial_keys[i & (BENCH_KEYS - 1)];
+
+        found += !!serial_find(&ctx->serials, s, strlen(s));
+    }
+    bench_report("serial_find", n, BENCH_LOOKUPS, now_ns() - start);
+
+    /* The parser splits in place, so each iteration works on a fresh copy */
+    start = now_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        memcpy(line, ctx->lines[i & (BENCH_KEYS - 1)], sizeof(line));
+        found += !parse_vidpid_line(line, &rule);
+    }
+    bench_report("parse_vidpid_line", n, BENCH_LOOKUPS, now_ns() - start);
+
+out:
+    bench_free(ctx);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    u32 n;
+    int i, rc;
+
+    if (argc < 2) {
+        for (n = 10; n <= 1000000; n *= 10) {
+            rc = bench_entries(n);
+            if (rc) return 1;
+        }
+        return 0;
+    }
+
+    for (i = 1; i < argc; i++) {
+        n = strtoul(argv[i], NULL, 0);
+        if (!n || n > BENCH_MAX_ENTRIES) {
+            fprintf(stderr, "usbguard-bench: entries must be 1..%d\n", BENCH_MAX_ENTRIES);
+            return 1;
+        }
+        rc = bench_entries(n);
+        if (rc) {
+            fprintf(stderr, "usbguard-bench: %s\n", strerror(-rc));
+            return 1;
+        }
+    }
+    return 0;
+}
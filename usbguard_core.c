@@ -0,0 +1,1690 @@
+/*
+ * usbguard_core.c - rule parser, lookup tables and snapshots of the usbguard policy
+ *
+ * Kernel/userspace portable: only uses what usbguard_shim.h provides.
+ */
+#include "usbguard_core.h"
+
+/* Trim whitespace */
+char *trim(char *s)
+{
+    char *end;
+    while (isspace(*s)) s++;
+    if (*s == 0) return s;
+    end = s + strlen(s) - 1;
+    while (end > s && isspace(*end)) *end-- = '\0';
+    return s;
+}
+
+/* Split off the next whitespace-delimited token */
+char *next_token(char **s)
+{
+    char *tok;
+
+    *s = skip_spaces(*s);
+    if (**s == '\0' || **s == '#') return NULL;
+    tok = *s;
+    while (**s && !isspace(**s)) (*s)++;
+    if (**s) *(*s)++ = '\0';
+    return tok;
+}
+
+/* Parse "PID", "LO-HI" or "PID/MASK" */
+static int parse_pid_spec(char *tok, struct vidpid *rule)
+{
+    char *sep = strpbrk(tok, "-/");
+    char op = sep ? *sep : '\0';
+    u16 arg;
+    int rc;
+
+    if (sep) *sep++ = '\0';
+    rc = kstrtou16(tok, 16, &rule->pid);
+    if (rc) return rc;
+    rule->pid_hi = rule->pid;
+    rule->mask = 0xFFFF;
+    if (!op) return 0;
+
+    rc = kstrtou16(sep, 16, &arg);
+    if (rc) return rc;
+    if (op == '-') {
+        if (arg < rule->pid) return -EINVAL;
+        rule->pid_hi = arg;
+    } else {
+        rule->mask = arg;
+        rule->pid &= arg;
+        rule->pid_hi = rule->pid;
+    }
+    return 0;
+}
+
+/* Parse VID/PID line */
+int parse_vidpid_line(char *line, struct vidpid *rule)
+{
+    char *p = trim(line);
+    char *vtok, *ptok;
+    int rc;
+
+    if (p[0] == '\0' || p[0] == '#') return -EINVAL;
+
+    vtok = next_token(&p);
+    ptok = next_token(&p);
+    if (!vtok || !ptok || next_token(&p)) return -EINVAL;
+
+    rc = kstrtou16(vtok, 16, &rule->vid);
+    if (rc) return rc;
+    return parse_pid_spec(ptok, rule);
+}
+
+/* Parse "fp <hash>" line */
+int parse_fingerprint_line(char *line, u64 *fp)
+{
+    char *p = trim(line);
+    char *tok = next_token(&p);
+    int rc;
+
+    if (!tok || strcmp(tok, "fp")) return -EINVAL;
+    tok = next_token(&p);
+    if (!tok || next_token(&p)) return -EINVAL;
+
+    rc = kstrtou64(tok, 16, fp);
+    if (rc) return rc;
+    return *fp ? 0 : -EINVAL;
+}
+
+/*
+ * Feed each line of a NUL-terminated buffer of count bytes to apply(),
+ * splitting it in place. Lines apply() rejects are skipped; -ENOMEM and
+ * -ENOSPC stop the walk and are returned. *done is the offset just past
+ * the last line handled and *accepted the number of lines taken.
+ */
+int apply_lines(char *buf, size_t count, int (*apply)(void *arg, char *line), void *arg,
+                size_t *done, size_t *accepted)
+{
+    char *line, *next;
+    int rc;
+
+    *done = *accepted = 0;
+    for (line = buf; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+
+        rc = apply(arg, line);
+        if (rc == -ENOMEM || rc == -ENOSPC) return rc;
+        if (!rc) (*accepted)++;
+        *done = next ? next - buf : count;
+    }
+    return 0;
+}
+
+/*
+ * Feed each line of a read-only blob, such as a rules file, to apply()
+ * through a bounded copy. Returns the number of lines skipped because they
+ * do not fit in RULE_LINE_MAX.
+ */
+u32 apply_blob_lines(const char *data, size_t size, int (*apply)(void *arg, char *line),
+                     void *arg)
+{
+    char line[RULE_LINE_MAX];
+    u32 skipped = 0;
+
+    while (size) {
+        const char *nl = memchr(data, '\n', size);
+        size_t len = nl ? nl - data : size;
+
+        if (len < sizeof(line)) {
+            memcpy(line, data, len);
+            line[len] = '\0';
+            apply(arg, line);
+        } else {
+            skipped++;
+        }
+
+        if (!nl) break;
+        size -= len + 1;
+        data = nl + 1;
+    }
+    return skipped;
+}
+
+/* Look up a fingerprint and count the hit */
+bool fp_set_match(const struct fp_set *set, u64 fp)
+{
+    u32 i;
+
+    if (!set->count) return false;
+    for (i = fp & set->mask; set->slots[i]; i = (i + 1) & set->mask) {
+        if (set->slots[i] == fp) {
+            atomic_long_inc(&set->hits[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void fp_set_insert(struct fp_set *set, u64 fp, long hits)
+{
+    u32 i;
+
+    for (i = fp & set->mask; set->slots[i]; i = (i + 1) & set->mask)
+        if (set->slots[i] == fp)
+            return;
+    set->slots[i] = fp;
+    atomic_long_set(&set->hits[i], hits);
+    set->count++;
+}
+
+/* Double the table, keeping the load factor at or below 1/2 */
+static int fp_set_grow(struct fp_set *set)
+{
+    struct fp_set bigger = {0};
+    u32 size = set->slots ? (set->mask + 1) * 2 : FP_SET_MIN;
+    u32 i;
+
+    bigger.slots = kvcalloc(size, sizeof(*bigger.slots), GFP_KERNEL);
+    bigger.hits = kvcalloc(size, sizeof(*bigger.hits), GFP_KERNEL);
+    if (!bigger.slots || !bigger.hits) {
+        kvfree(bigger.slots);
+        kvfree(bigger.hits);
+        return -ENOMEM;
+    }
+    bigger.mask = size - 1;
+
+    for (i = 0; set->slots && i <= set->mask; i++)
+        if (set->slots[i])
+            fp_set_insert(&bigger, set->slots[i], atomic_long_read(&set->hits[i]));
+
+    kvfree(set->slots);
+    kvfree(set->hits);
+    *set = bigger;
+    return 0;
+}
+
+int fp_set_add(struct fp_set *set, u64 fp)
+{
+    int rc;
+
+    if (!set->slots || (set->count + 1) * 2 > set->mask + 1) {
+        rc = fp_set_grow(set);
+        if (rc) return rc;
+    }
+    fp_set_insert(set, fp, 0);
+    return 0;
+}
+
+/* Delete by shifting later probe-chain entries back over the hole */
+bool fp_set_remove(struct fp_set *set, u64 fp)
+{
+    u32 i, j, home;
+
+    if (!set->count) return false;
+    for (i = fp & set->mask; set->slots[i] != fp; i = (i + 1) & set->mask)
+        if (!set->slots[i])
+            return false;
+
+    for (j = (i + 1) & set->mask; set->slots[j]; j = (j + 1) & set->mask) {
+        home = set->slots[j] & set->mask;
+        /* the entry may move to i unless its home lies cyclically in (i, j] */
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            set->slots[i] = set->slots[j];
+            set->hits[i] = set->hits[j];
+            i = j;
+        }
+    }
+    set->slots[i] = 0;
+    set->count--;
+    return true;
+}
+
+void fp_set_free(struct fp_set *set)
+{
+    kvfree(set->slots);
+    kvfree(set->hits);
+    memset(set, 0, sizeof(*set));
+}
+
+int fp_set_copy(struct fp_set *dst, const struct fp_set *src)
+{
+    *dst = *src;
+    if (!src->slots) return 0;
+    dst->slots = kvmalloc_array(src->mask + 1, sizeof(*src->slots), GFP_KERNEL);
+    dst->hits = kvmalloc_array(src->mask + 1, sizeof(*src->hits), GFP_KERNEL);
+    if (!dst->slots || !dst->hits) {
+        kvfree(dst->slots);
+        kvfree(dst->hits);
+        dst->slots = NULL;
+        dst->hits = NULL;
+        return -ENOMEM;
+    }
+    memcpy(dst->slots, src->slots, (src->mask + 1) * sizeof(*src->slots));
+    memcpy(dst->hits, src->hits, (src->mask + 1) * sizeof(*src->hits));
+    return 0;
+}
+
+/* Index of the first range ending at or after key */
+static size_t ruleset_lower_bound(const struct ruleset *set, u32 key)
+{
+    size_t lo = 0, hi = set->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (set->ranges[mid].hi < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Look up a key and count the hit on its range */
+bool ruleset_match(const struct ruleset *set, u32 key)
+{
+    size_t i = ruleset_lower_bound(set, key);
+
+    if (i == set->count || set->ranges[i].lo > key) return false;
+    atomic_long_inc(&set->hits[i]);
+    return true;
+}
+
+/* Make room for n more ranges */
+static int ruleset_reserve(struct ruleset *set, size_t n)
+{
+    size_t cap = max3(set->cap * 2, set->count + n, (size_t)16);
+    struct vidpid_range *r;
+    atomic_long_t *hits;
+
+    if (set->count + n > MAX_RULES) return -ENOSPC;
+    if (set->count + n <= set->cap) return 0;
+
+    r = kv_grow(set->ranges, set->count * sizeof(*r), array_size(cap, sizeof(*r)));
+    if (!r) return -ENOMEM;
+    set->ranges = r;
+    hits = kv_grow(set->hits, set->count * sizeof(*hits), array_size(cap, sizeof(*hits)));
+    if (!hits) return -ENOMEM;
+    set->hits = hits;
+    set->cap = cap;
+    return 0;
+}
+
+/* Move n ranges and their hit counters from index src to dst */
+static void ruleset_move(struct ruleset *set, size_t dst, size_t src, size_t n)
+{
+    memmove(&set->ranges[dst], &set->ranges[src], n * sizeof(*set->ranges));
+    memmove(&set->hits[dst], &set->hits[src], n * sizeof(*set->hits));
+}
+
+/* Overlapping, or touching without crossing into another VID */
+static bool range_joinable(const struct vidpid_range *r, u32 lo, u32 hi)
+{
+    if (r->lo <= hi && lo <= r->hi)
+        return true;
+    if ((u64)r->hi + 1 == lo && (lo & 0xFFFF))
+        return true;
+    return (u64)hi + 1 == r->lo && (r->lo & 0xFFFF);
+}
+
+/*
+ * Insert [lo, hi], merging it with every range it overlaps or touches;
+ * the merged range keeps the sum of their hit counts.
+ */
+int ruleset_add_range(struct ruleset *set, u32 lo, u32 hi)
+{
+    size_t i = ruleset_lower_bound(set, lo);
+    long hits = 0;
+    size_t j;
+
+    if (i > 0 && range_joinable(&set->ranges[i - 1], lo, hi))
+        i--;
+    for (j = i; j < set->count && range_joinable(&set->ranges[j], lo, hi); j++) {
+        lo = min(lo, set->ranges[j].lo);
+        hi = max(hi, set->ranges[j].hi);
+        hits += atomic_long_read(&set->hits[j]);
+    }
+
+    if (j == i) {
+        int rc = ruleset_reserve(set, 1);
+
+        if (rc) return rc;
+        ruleset_move(set, i + 1, i, set->count - i);
+        set->count++;
+    } else {
+        ruleset_move(set, i + 1, j, set->count - j);
+        set->count -= j - i - 1;
+    }
+    set->ranges[i].lo = lo;
+    set->ranges[i].hi = hi;
+    atomic_long_set(&set->hits[i], hits);
+    return 0;
+}
+
+/* Remove [lo, hi], trimming or splitting the ranges it overlaps */
+static int ruleset_remove_range(struct ruleset *set, u32 lo, u32 hi)
+{
+    size_t i = ruleset_lower_bound(set, lo);
+    struct vidpid_range *r = &set->ranges[i];
+    size_t j;
+    int rc;
+
+    if (i == set->count || r->lo > hi) return -ENOENT;
+
+    if (r->lo < lo && r->hi > hi) {
+        rc = ruleset_reserve(set, 1);
+        if (rc) return rc;
+        ruleset_move(set, i + 1, i, set->count - i);
+        r = &set->ranges[i];
+        set->count++;
+        r[0].hi = lo - 1;
+        r[1].lo = hi + 1;
+        return 0;
+    }
+    if (r->lo < lo) {
+        r->hi = lo - 1;
+        i++;
+    }
+
+    for (j = i; j < set->count && set->ranges[j].hi <= hi; j++)
+        ;
+    if (j < set->count && set->ranges[j].lo <= hi)
+        set->ranges[j].lo = hi + 1;
+    ruleset_move(set, i, j, set->count - j);
+    set->count -= j - i;
+    return 0;
+}
+
+/* 1 if removing [lo, hi] would split the range around it in two */
+static size_t ruleset_splits(const struct ruleset *set, u32 lo, u32 hi)
+{
+    size_t i = ruleset_lower_bound(set, lo);
+
+    return i < set->count && set->ranges[i].lo < lo && set->ranges[i].hi > hi;
+}
+
+/*
+ * Add or remove a parsed rule. A mask whose clear bits are not all at the
+ * bottom expands to one range per combination of the upper clear bits.
+ */
+int ruleset_update(struct ruleset *set, const struct vidpid *rule, bool remove)
+{
+    int (*op)(struct ruleset *, u32, u32) =
+        remove ? ruleset_remove_range : ruleset_add_range;
+    u16 free_bits = ~rule->mask;
+    u16 low = free_bits & ~(free_bits + 1);
+    u16 high = free_bits & ~low;
+    u32 base = (u32)rule->vid << 16;
+    bool found = false;
+    size_t need = 0;
+    u16 sub = 0;
+    int rc;
+
+    if (rule->mask == 0xFFFF)
+        return op(set, base | rule->pid, base | rule->pid_hi);
+    if (hweight16(high) > ilog2(MASK_RANGES_MAX))
+        return -E2BIG;
+
+    /*
+     * An add step adds at most one range and a remove step only does when
+     * it splits one; reserve them all so a full table fails cleanly.
+     */
+    do {
+        u16 pid = rule->pid | sub;
+
+        need += remove ? ruleset_splits(set, base | pid, base | pid | low) : 1;
+        sub = (sub - high) & high;
+    } while (sub);
+    rc = ruleset_reserve(set, need);
+    if (rc) return rc;
+
+    do {
+        u16 pid = rule->pid | sub;
+
+        rc = op(set, base | pid, base | pid | low);
+        if (rc && rc != -ENOENT) return rc;
+        found |= !rc;
+        sub = (sub - high) & high;
+    } while (sub);
+    return found ? 0 : -ENOENT;
+}
+
+void ruleset_free(struct ruleset *set)
+{
+    kvfree(set->ranges);
+    kvfree(set->hits);
+    set->ranges = NULL;
+    set->hits = NULL;
+    set->count = set->cap = 0;
+}
+
+int ruleset_copy(struct ruleset *dst, const struct ruleset *src)
+{
+    *dst = *src;
+    if (!src->ranges) return 0;
+    dst->ranges = kvmemdup(src->ranges, src->cap * sizeof(*src->ranges), GFP_KERNEL);
+    dst->hits = kvmemdup(src->hits, src->cap * sizeof(*src->hits), GFP_KERNEL);
+    if (dst->ranges && dst->hits) return 0;
+    ruleset_free(dst);
+    return -ENOMEM;
+}
+
+/*
+ * The low 32 bits of the hash pick the index slot, bits 32-45 the Bloom
+ * block and bits 46-63 seed the double hashing of bits within the block.
+ */
+static u64 serial_hash(const char *s, size_t len)
+{
+    return xxh64(s, len, 0);
+}
+
+static unsigned long *bloom_block(const struct serial_set *set, u64 hash)
+{
+    u32 block = (hash >> 32) & (set->bloom_blocks - 1);
+
+    return set->bloom + block * BITS_TO_LONGS(BLOOM_BLOCK_BITS);
+}
+
+static void bloom_add(struct serial_set *set, u64 hash)
+{
+    unsigned long *block = bloom_block(set, hash);
+    u32 a = hash >> 55, b = hash >> 46 | 1;
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; i++)
+        __set_bit((a + i * b) % BLOOM_BLOCK_BITS, block);
+}
+
+static bool bloom_test(const struct serial_set *set, u64 hash)
+{
+    const unsigned long *block = bloom_block(set, hash);
+    u32 a = hash >> 55, b = hash >> 46 | 1;
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; i++)
+        if (!test_bit((a + i * b) % BLOOM_BLOCK_BITS, block))
+            return false;
+    return true;
+}
+
+/* Resize the filter for count serials and re-add every serial */
+static int bloom_rebuild(struct serial_set *set, u32 count)
+{
+    u32 blocks = roundup_pow_of_two(DIV_ROUND_UP(count * BLOOM_BITS_PER_SERIAL, BLOOM_BLOCK_BITS));
+    const struct serial_ref *ref;
+    unsigned long *bloom;
+
+    bloom = kvcalloc(blocks * BITS_TO_LONGS(BLOOM_BLOCK_BITS), sizeof(*bloom), GFP_KERNEL);
+    if (!bloom) return -ENOMEM;
+    kvfree(set->bloom);
+    set->bloom = bloom;
+    set->bloom_blocks = blocks;
+    serial_set_for_each(set, ref)
+        bloom_add(set, ref->hash);
+    return 0;
+}
+
+struct serial_ref *serial_find(const struct serial_set *set, const char *s, size_t len)
+{
+    u64 hash;
+    u32 i, v;
+
+    if (!set->count || !len) return NULL;
+    hash = serial_hash(s, len);
+    if (!bloom_test(set, hash)) return NULL;
+    for (i = hash & set->mask; (v = set->index[i]); i = (i + 1) & set->mask) {
+        struct serial_ref *ref = &set->refs[v - 1];
+
+        if (ref->hash == hash && ref->len == len && !memcmp(set->arena + ref->off, s, len))
+            return ref;
+    }
+    return NULL;
+}
+
+static void serial_index_insert(u32 *index, u32 mask, u64 hash, u32 v)
+{
+    u32 i;
+
+    for (i = hash & mask; index[i]; i = (i + 1) & mask)
+        ;
+    index[i] = v;
+}
+
+/* Double the index, keeping the load factor at or below 1/2 */
+static int serial_index_grow(struct serial_set *set)
+{
+    u32 size = set->index ? (set->mask + 1) * 2 : SERIAL_INDEX_MIN;
+    const struct serial_ref *ref;
+    u32 *index;
+
+    index = kvcalloc(size, sizeof(*index), GFP_KERNEL);
+    if (!index) return -ENOMEM;
+    serial_set_for_each(set, ref)
+        serial_index_insert(index, size - 1, ref->hash, ref - set->refs + 1);
+
+    kvfree(set->index);
+    set->index = index;
+    set->mask = size - 1;
+    return 0;
+}
+
+/* Grow a buffer that may outgrow kmalloc, keeping its contents */
+void *kv_grow(void *old, size_t old_size, size_t new_size)
+{
+    void *p = kvmalloc(new_size, GFP_KERNEL);
+
+    if (!p) return NULL;
+    if (old) memcpy(p, old, old_size);
+    kvfree(old);
+    return p;
+}
+
+/* Append a serial that is not in the set yet */
+int serial_set_add(struct serial_set *set, const char *s, size_t len)
+{
+    struct serial_ref *ref;
+    int rc;
+
+    if (set->arena_len + len > set->arena_cap) {
+        size_t cap = max3(set->arena_cap * 2, set->arena_len + len, (size_t)256);
+        char *arena = kv_grow(set->arena, set->arena_len, cap);
+
+        if (!arena) return -ENOMEM;
+        set->arena = arena;
+        set->arena_cap = cap;
+    }
+    if (set->nr_refs == set->refs_cap) {
+        u32 cap = set->refs_cap ? set->refs_cap * 2 : 16;
+        struct serial_ref *refs = kv_grow(set->refs, set->nr_refs * sizeof(*refs),
+                                          array_size(cap, sizeof(*refs)));
+
+        if (!refs) return -ENOMEM;
+        set->refs = refs;
+        set->refs_cap = cap;
+    }
+    /* removed refs still take index slots and filter bits until compaction */
+    if (!set->index || (set->nr_refs + 1) * 2 > set->mask + 1) {
+        rc = serial_index_grow(set);
+        if (rc) return rc;
+    }
+    if ((set->nr_refs + 1) * BLOOM_BITS_PER_SERIAL > set->bloom_blocks * BLOOM_BLOCK_BITS) {
+        rc = bloom_rebuild(set, max(set->nr_refs * 2, 1U));
+        if (rc) return rc;
+    }
+
+    ref = &set->refs[set->nr_refs];
+    ref->off = set->arena_len;
+    ref->len = len;
+    ref->hash = serial_hash(s, len);
+    atomic_long_set(&ref->hits, 0);
+    memcpy(set->arena + set->arena_len, s, len);
+    set->arena_len += len;
+    set->nr_refs++;
+    set->count++;
+    serial_index_insert(set->index, set->mask, ref->hash, set->nr_refs);
+    bloom_add(set, ref->hash);
+    return 0;
+}
+
+void serial_set_free(struct serial_set *set)
+{
+    kvfree(set->arena);
+    kvfree(set->refs);
+    kvfree(set->index);
+    kvfree(set->bloom);
+    memset(set, 0, sizeof(*set));
+}
+
+/* Rebuild the set from its live serials, repacking the arena */
+static int serial_set_compact(struct serial_set *set)
+{
+    struct serial_set out = {0};
+    const struct serial_ref *ref;
+    int rc;
+
+    serial_set_for_each(set, ref) {
+        rc = serial_set_add(&out, set->arena + ref->off, ref->len);
+        if (rc) {
+            serial_set_free(&out);
+            return rc;
+        }
+        out.refs[out.nr_refs - 1].hits = ref->hits;
+    }
+    serial_set_free(set);
+    *set = out;
+    return 0;
+}
+
+/*
+ * Mark one serial removed. Removal itself cannot fail; when the set is
+ * compacted and that runs out of memory, the marks stay until the next try.
+ */
+int serial_set_remove(struct serial_set *set, struct serial_ref *victim)
+{
+    u32 dead;
+
+    victim->len = 0;
+    set->count--;
+    dead = set->nr_refs - set->count;
+    if (dead > max_t(u32, set->count, SERIAL_INDEX_MIN))
+        serial_set_compact(set);
+    return 0;
+}
+
+int serial_set_copy(struct serial_set *dst, const struct serial_set *src)
+{
+    memset(dst, 0, sizeof(*dst));
+    if (!src->count) return 0;
+
+    dst->arena = kvmemdup(src->arena, src->arena_len, GFP_KERNEL);
+    dst->refs = kvmemdup(src->refs, src->nr_refs * sizeof(*src->refs), GFP_KERNEL);
+    dst->index = kvmalloc_array(src->mask + 1, sizeof(*src->index), GFP_KERNEL);
+    dst->bloom = kvmalloc_array(src->bloom_blocks * BITS_TO_LONGS(BLOOM_BLOCK_BITS),
+                                sizeof(*src->bloom), GFP_KERNEL);
+    if (!dst->arena || !dst->refs || !dst->index || !dst->bloom) {
+        serial_set_free(dst);
+        return -ENOMEM;
+    }
+    memcpy(dst->index, src->index, (src->mask + 1) * sizeof(*src->index));
+    memcpy(dst->bloom, src->bloom,
+           src->bloom_blocks * BITS_TO_LONGS(BLOOM_BLOCK_BITS) * sizeof(*src->bloom));
+    dst->bloom_blocks = src->bloom_blocks;
+    dst->arena_len = dst->arena_cap = src->arena_len;
+    dst->nr_refs = dst->refs_cap = src->nr_refs;
+    dst->count = src->count;
+    dst->mask = src->mask;
+    return 0;
+}
+
+#ifdef USBGUARD_DEBUG
+/* Sorted, within one VID per range and fully merged */
+int ruleset_check(const struct ruleset *set)
+{
+    size_t i;
+
+    if (set->count > set->cap || set->count > MAX_RULES) return -EINVAL;
+    for (i = 0; i < set->count; i++) {
+        const struct vidpid_range *r = &set->ranges[i];
+
+        if (r->lo > r->hi || r->lo >> 16 != r->hi >> 16) return -EINVAL;
+        if (i && (r[-1].hi >= r->lo || range_joinable(&r[-1], r->lo, r->hi)))
+            return -EINVAL;
+    }
+    return 0;
+}
+
+/* Every entry reachable from its home slot, load factor at most 1/2 */
+int fp_set_check(const struct fp_set *set)
+{
+    u32 i, j, n = 0;
+
+    for (i = 0; set->slots && i <= set->mask; i++) {
+        if (!set->slots[i]) continue;
+        for (j = set->slots[i] & set->mask; j != i; j = (j + 1) & set->mask)
+            if (!set->slots[j])
+                return -EINVAL;
+        n++;
+    }
+    if (n != set->count) return -EINVAL;
+    return set->slots && n * 2 > set->mask + 1 ? -EINVAL : 0;
+}
+
+/* Every live serial inside the arena and found again through filter and index */
+int serial_set_check(const struct serial_set *set)
+{
+    const struct serial_ref *ref;
+    u32 n = 0;
+
+    if (set->count > MAX_SERIALS || set->nr_refs > set->refs_cap) return -EINVAL;
+    serial_set_for_each(set, ref) {
+        if (ref->off + ref->len > set->arena_len) return -EINVAL;
+        if (serial_find(set, set->arena + ref->off, ref->len) != ref) return -EINVAL;
+        n++;
+    }
+    return n == set->count ? 0 : -EINVAL;
+}
+#endif
+
+u32 port_hash(const char *name, size_t len)
+{
+    return jhash(name, len, 0);
+}
+
+/* Find the rules for a port */
+struct usbguard_port *port_lookup(const struct usbguard_policy *pol, const char *name,
+                                  size_t len)
+{
+    struct usbguard_port *port;
+
+    hash_for_each_possible(pol->ports, port, node, port_hash(name, len))
+        if (strlen(port->name) == len && !memcmp(port->name, name, len))
+            return port;
+    return NULL;
+}
+
+static struct usbguard_port *port_get(struct usbguard_policy *pol, const char *name)
+{
+    size_t len = strlen(name);
+    struct usbguard_port *port;
+
+    if (len == 0 || len >= PORT_NAME_MAX) return ERR_PTR(-EINVAL);
+
+    port = port_lookup(pol, name, len);
+    if (port) return port;
+
+    port = kzalloc(sizeof(*port), GFP_KERNEL);
+    if (!port) return ERR_PTR(-ENOMEM);
+    strscpy(port->name, name, sizeof(port->name));
+    hash_add(pol->ports, &port->node, port_hash(name, len));
+    return port;
+}
+
+static void port_put(struct usbguard_port *port)
+{
+    if (port->rules.count || port->ns) return;
+    hash_del(&port->node);
+    ruleset_free(&port->rules);
+    kfree(port);
+}
+
+/* Length of the parent port name ("1-1.2" for "1-1.2.3"), 0 at the root */
+size_t port_parent(const char *name, size_t len)
+{
+    while (len && name[len - 1] != '.')
+        len--;
+    return len ? len - 1 : 0;
+}
+
+struct usbguard_view *view_lookup(const struct usbguard_policy *pol, u32 ns)
+{
+    struct usbguard_view *view;
+
+    hash_for_each_possible(pol->views, view, node, ns)
+        if (view->ns == ns)
+            return view;
+    return NULL;
+}
+
+static struct usbguard_view *view_get(struct usbguard_policy *pol, u32 ns)
+{
+    struct usbguard_view *view = view_lookup(pol, ns);
+
+    if (view) return view;
+    if (pol->nr_views >= MAX_VIEWS) return ERR_PTR(-ENOSPC);
+
+    view = kzalloc(sizeof(*view), GFP_KERNEL);
+    if (!view) return ERR_PTR(-ENOMEM);
+    view->ns = ns;
+    hash_add(pol->views, &view->node, ns);
+    pol->nr_views++;
+    return view;
+}
+
+static void view_put(struct usbguard_policy *pol, struct usbguard_view *view)
+{
+    if (view->rules.count || view->nr_ports) return;
+    hash_del(&view->node);
+    ruleset_free(&view->rules);
+    kfree(view);
+    pol->nr_views--;
+}
+
+/* Bind a port (and the ports below it) to a view, or undo the binding */
+static int view_bind(struct usbguard_policy *pol, struct usbguard_view *view,
+                     const char *name, bool remove)
+{
+    struct usbguard_port *port;
+
+    if (remove) {
+        port = port_lookup(pol, name, strlen(name));
+        if (!port || port->ns != view->ns) return -ENOENT;
+        port->ns = 0;
+        view->nr_ports--;
+        port_put(port);
+        return 0;
+    }
+
+    port = port_get(pol, name);
+    if (IS_ERR(port)) return PTR_ERR(port);
+    if (port->ns) return port->ns == view->ns ? 0 : -EBUSY;
+    port->ns = view->ns;
+    view->nr_ports++;
+    return 0;
+}
+
+/*
+ * Apply a view line to an unpublished policy: "%NS @PORT" binds a port
+ * to the view of user namespace NS, "%NS VID PID" adds a rule to it.
+ */
+static int apply_view_line(struct usbguard_policy *pol, char *line, bool remove,
+                           const char *origin)
+{
+    char *tok = next_token(&line);
+    struct usbguard_view *view;
+    struct vidpid rule;
+    u32 ns;
+    int rc;
+
+    if (!tok || kstrtou32(tok + 1, 10, &ns) || !ns) return -EINVAL;
+    view = remove ? view_lookup(pol, ns) : view_get(pol, ns);
+    if (!view) return -ENOENT;
+    if (IS_ERR(view)) return PTR_ERR(view);
+
+    line = skip_spaces(line);
+    if (line[0] == '@') {
+        tok = next_token(&line) + 1;
+        rc = next_token(&line) ? -EINVAL : view_bind(pol, view, tok, remove);
+        if (!rc)
+            pr_info("usbguard: %s %s port %s %s view %u\n", origin,
+                    remove ? "unbound" : "bound", tok, remove ? "from" : "to", ns);
+    } else {
+        rc = parse_vidpid_line(line, &rule);
+        if (!rc) rc = ruleset_update(&view->rules, &rule, remove);
+        if (!rc)
+            pr_info("usbguard: %s %s view %u rule %04x:%04x-%04x/%04x\n", origin,
+                    remove ? "removed" : "added", ns,
+                    rule.vid, rule.pid, rule.pid_hi, rule.mask);
+    }
+    view_put(pol, view);
+    return rc;
+}
+
+static struct usbguard_quota *quota_find(const struct usbguard_policy *pol,
+                                         const char *port, u8 class)
+{
+    u32 i;
+
+    for (i = 0; i < pol->nr_quotas; i++)
+        if (pol->quotas[i].class == class && !strcmp(pol->quotas[i].port, port))
+            return &pol->quotas[i];
+    return NULL;
+}
+
+/* Set a quota in an unpublished policy; setting it again changes max */
+static int quota_set(struct usbguard_policy *pol, const char *port, u8 class, u32 max)
+{
+    struct usbguard_quota *q = quota_find(pol, port, class), *quotas;
+
+    if (strlen(port) >= PORT_NAME_MAX) return -EINVAL;
+    if (!q) {
+        if (pol->nr_quotas >= MAX_QUOTAS) return -ENOSPC;
+        quotas = krealloc_array(pol->quotas, pol->nr_quotas + 1, sizeof(*quotas), GFP_KERNEL);
+        if (!quotas) return -ENOMEM;
+        pol->quotas = quotas;
+        q = &quotas[pol->nr_quotas++];
+        strscpy(q->port, port, sizeof(q->port));
+        q->class = class;
+    }
+    q->max = max;
+    return 0;
+}
+
+/*
+ * Apply "quota [@PORT] CLASS MAX" to an unpublished policy: at most MAX
+ * devices with an interface of CLASS (hex) at once, anywhere or below
+ * PORT. "-quota [@PORT] CLASS" removes it.
+ */
+static int apply_quota_line(struct usbguard_policy *pol, char *line, bool remove,
+                            const char *origin)
+{
+    const char *port = "";
+    struct usbguard_quota *q;
+    char *tok, *max_tok;
+    u8 class;
+    u32 max = 0;
+    int rc;
+
+    next_token(&line);
+    tok = next_token(&line);
+    if (tok && tok[0] == '@') {
+        port = tok + 1;
+        if (!port[0]) return -EINVAL;
+        tok = next_token(&line);
+    }
+    max_tok = next_token(&line);
+    if (!tok || kstrtou8(tok, 16, &class) || next_token(&line)) return -EINVAL;
+    if (max_tok ? kstrtou32(max_tok, 10, &max) : !remove) return -EINVAL;
+
+    if (remove) {
+        q = quota_find(pol, port, class);
+        if (!q) return -ENOENT;
+        max = q->max;
+        *q = pol->quotas[--pol->nr_quotas];
+    } else {
+        rc = quota_set(pol, port, class, max);
+        if (rc) return rc;
+    }
+    pr_info("usbguard: %s %s quota %s%s%sclass %02x max %u\n", origin,
+            remove ? "removed" : "set", port[0] ? "port " : "", port, port[0] ? " " : "",
+            class, max);
+    return 0;
+}
+
+static struct usbguard_grant *grant_find(const struct grant_list *gl, const struct vidpid *rule)
+{
+    u32 i;
+
+    for (i = 0; i < gl->count; i++)
+        if (!memcmp(&gl->items[i].rule, rule, sizeof(*rule)))
+            return &gl->items[i];
+    return NULL;
+}
+
+/* Recompile the merged ranges from the remaining grants */
+static int grants_rebuild(struct grant_list *gl)
+{
+    struct ruleset set = {};
+    u32 i;
+    int rc;
+
+    for (i = 0; i < gl->count; i++) {
+        rc = ruleset_update(&set, &gl->items[i].rule, false);
+        if (rc) {
+            ruleset_free(&set);
+            return rc;
+        }
+    }
+    ruleset_free(&gl->set);
+    gl->set = set;
+    return 0;
+}
+
+/* Grant a rule for secs seconds; granting it again extends the expiry */
+static int grant_add(struct grant_list *gl, const struct vidpid *rule, u32 secs)
+{
+    u64 expires = get_jiffies_64() + (u64)secs * HZ;
+    struct usbguard_grant *g = grant_find(gl, rule);
+    int rc;
+
+    if (g) {
+        g->expires = max(g->expires, expires);
+        return 0;
+    }
+    if (gl->count >= MAX_GRANTS) return -ENOSPC;
+    if (gl->count == gl->cap) {
+        u32 cap = max(gl->cap * 2, 16U);
+        struct usbguard_grant *items = kv_grow(gl->items, gl->count * sizeof(*items),
+                                               array_size(cap, sizeof(*items)));
+
+        if (!items) return -ENOMEM;
+        gl->items = items;
+        gl->cap = cap;
+    }
+    rc = ruleset_update(&gl->set, rule, false);
+    if (rc) return rc;
+    gl->items[gl->count].rule = *rule;
+    gl->items[gl->count].expires = expires;
+    gl->count++;
+    return 0;
+}
+
+/* Drop every grant that expired by now and count them in expired */
+int grants_expire(struct grant_list *gl, u64 now, u32 *expired)
+{
+    u32 i, n = 0;
+
+    for (i = 0; i < gl->count; i++)
+        if (time_after64(gl->items[i].expires, now))
+            gl->items[n++] = gl->items[i];
+    *expired = gl->count - n;
+    gl->count = n;
+    return *expired ? grants_rebuild(gl) : 0;
+}
+
+static int grant_remove(struct grant_list *gl, const struct vidpid *rule)
+{
+    struct usbguard_grant *g = grant_find(gl, rule), victim;
+    int rc;
+
+    if (!g) return -ENOENT;
+    victim = *g;
+    *g = gl->items[--gl->count];
+    rc = grants_rebuild(gl);
+    if (rc) {
+        /* the last item is still in place past count */
+        *g = victim;
+        gl->count++;
+    }
+    return rc;
+}
+
+/* Earliest expiry of a non-empty grant list */
+u64 grants_next(const struct grant_list *gl)
+{
+    u64 next = gl->items[0].expires;
+    u32 i;
+
+    for (i = 1; i < gl->count; i++)
+        if (time_before64(gl->items[i].expires, next))
+            next = gl->items[i].expires;
+    return next;
+}
+
+static void grant_list_free(struct grant_list *gl)
+{
+    kvfree(gl->items);
+    ruleset_free(&gl->set);
+}
+
+int grant_list_copy(struct grant_list *dst, const struct grant_list *src)
+{
+    *dst = (struct grant_list){};
+    if (!src->count) return 0;
+    dst->items = kvmemdup(src->items, src->count * sizeof(*src->items), GFP_KERNEL);
+    if (!dst->items) return -ENOMEM;
+    dst->count = dst->cap = src->count;
+    return ruleset_copy(&dst->set, &src->set);
+}
+
+/*
+ * Split a trailing "ttl=N" token (seconds, or with an s/m/h/d suffix) off
+ * a rule line. Returns 1 with the seconds in secs, 0 without one.
+ */
+static int take_ttl(char *line, u32 *secs)
+{
+    static const struct { char suffix; u32 mult; } units[] = {
+        { 's', 1 }, { 'm', 60 }, { 'h', 3600 }, { 'd', 86400 },
+    };
+    char *p = strstr(line, "ttl=");
+    size_t len;
+    u32 mult = 1;
+    int i;
+
+    if (!p || p == line || !isspace(p[-1])) return 0;
+    p[-1] = '\0';
+    p += 4;
+    len = strlen(p);
+    for (i = 0; len && i < ARRAY_SIZE(units); i++) {
+        if (p[len - 1] == units[i].suffix) {
+            mult = units[i].mult;
+            p[--len] = '\0';
+            break;
+        }
+    }
+    if (kstrtou32(p, 10, secs) || *secs > GRANT_TTL_MAX / mult) return -EINVAL;
+    *secs *= mult;
+    return 1;
+}
+
+/*
+ * Apply one rule line (VID/PID or fingerprint) to an unpublished policy;
+ * a leading '-' removes the rule instead.
+ */
+int apply_rule_line(struct usbguard_policy *pol, char *line, const char *origin)
+{
+    char buf[RULE_LINE_MAX];
+    struct ruleset *set = &pol->rules;
+    struct usbguard_port *port = NULL;
+    char *port_name = NULL;
+    struct vidpid rule;
+    bool remove;
+    u32 ttl;
+    u64 fp;
+    int rc;
+
+    line = trim(line);
+    remove = line[0] == '-';
+    if (remove) line++;
+    if (line[0] == '%')
+        return apply_view_line(pol, line, remove, origin);
+    if (!strncmp(line, "quota", 5) && isspace(line[5]))
+        return apply_quota_line(pol, line, remove, origin);
+
+    rc = take_ttl(line, &ttl);
+    if (rc < 0) return rc;
+    if (rc) {
+        if (line[0] == '@') return -EINVAL;
+        rc = parse_vidpid_line(line, &rule);
+        if (rc) return rc;
+        if (remove) rc = grant_remove(&pol->grants, &rule);
+        else if (ttl) rc = grant_add(&pol->grants, &rule, ttl);
+        else rc = -EINVAL;
+        if (rc) return rc;
+        if (remove)
+            pr_info("usbguard: %s revoked temporary rule %04x:%04x-%04x/%04x\n", origin,
+                    rule.vid, rule.pid, rule.pid_hi, rule.mask);
+        else
+            pr_info("usbguard: %s granted rule %04x:%04x-%04x/%04x for %us\n", origin,
+                    rule.vid, rule.pid, rule.pid_hi, rule.mask, ttl);
+        return 0;
+    }
+
+    if (line[0] == '@')
+        port_name = next_token(&line) + 1;
+
+    /* parsers split the line in place, keep a copy for the second try */
+    strscpy(buf, line, sizeof(buf));
+
+    if (!port_name && parse_fingerprint_line(buf, &fp) == 0) {
+        if (remove) {
+            if (!fp_set_remove(&pol->fingerprints, fp)) return -ENOENT;
+        } else {
+            rc = fp_set_add(&pol->fingerprints, fp);
+            if (rc) return rc;
+        }
+        pr_info("usbguard: %s %s fingerprint rule %016llx\n", origin,
+                remove ? "removed" : "added", fp);
+        return 0;
+    }
+
+    rc = parse_vidpid_line(line, &rule);
+    if (rc) return rc;
+
+    if (port_name) {
+        size_t len = strlen(port_name);
+
+        port = remove ? port_lookup(pol, port_name, len) : port_get(pol, port_name);
+        if (!port) return -ENOENT;
+        if (IS_ERR(port)) return PTR_ERR(port);
+        set = &port->rules;
+    }
+    rc = ruleset_update(set, &rule, remove);
+    if (port) port_put(port);
+    if (rc) return rc;
+
+    pr_info("usbguard: %s %s rule %s%s%04x:%04x-%04x/%04x\n", origin,
+            remove ? "removed" : "added",
+            port_name ? port_name : "", port_name ? " " : "",
+            rule.vid, rule.pid, rule.pid_hi, rule.mask);
+    return 0;
+}
+
+/* Block a serial in an unpublished policy; blocking it twice is a no-op */
+static int serial_block(struct usbguard_policy *pol, const char *s, size_t len)
+{
+    if (serial_find(&pol->serials, s, len)) return 0;
+    if (pol->serials.count >= MAX_SERIALS) return -ENOSPC;
+    return serial_set_add(&pol->serials, s, len);
+}
+
+/* Block or unblock a serial in an unpublished policy */
+int apply_serial_line(struct usbguard_policy *pol, char *line, bool remove)
+{
+    char *s = trim(line);
+    size_t len = strlen(s);
+    struct serial_ref *ref;
+
+    if (len == 0) return -EINVAL;
+    if (!remove) return serial_block(pol, s, len);
+
+    ref = serial_find(&pol->serials, s, len);
+    if (!ref) return -ENOENT;
+    return serial_set_remove(&pol->serials, ref);
+}
+
+/* Apply one blocked_serials line; a leading '-' unblocks the serial */
+int apply_blocked_line(struct usbguard_policy *pol, char *line)
+{
+    char *s = trim(line);
+
+    if (*s == '-')
+        return apply_serial_line(pol, s + 1, true);
+    return apply_serial_line(pol, s, false);
+}
+
+/*
+ * Apply one line of a policy diff: "serial S" / "-serial S", or a rule
+ * line as for the rules attribute, optionally prefixed with '+'.
+ */
+int apply_diff_line(struct usbguard_policy *pol, char *line)
+{
+    char *p = trim(line), *op;
+
+    if (*p == '+')
+        p++;
+    op = p + (*p == '-');
+    if (!strncmp(op, "serial", 6) && isspace(op[6]))
+        return apply_serial_line(pol, op + 6, op != p);
+    return apply_rule_line(pol, p, "diff");
+}
+
+void policy_free(struct usbguard_policy *pol)
+{
+    struct usbguard_port *port;
+    struct usbguard_view *view;
+    struct hlist_node *tmp;
+    int bkt;
+
+    if (!pol) return;
+    serial_set_free(&pol->serials);
+    hash_for_each_safe(pol->ports, bkt, tmp, port, node) {
+        ruleset_free(&port->rules);
+        kfree(port);
+    }
+    hash_for_each_safe(pol->views, bkt, tmp, view, node) {
+        ruleset_free(&view->rules);
+        kfree(view);
+    }
+    grant_list_free(&pol->grants);
+    kfree(pol->quotas);
+    fp_set_free(&pol->fingerprints);
+    ruleset_free(&pol->rules);
+    kfree(pol);
+}
+
+/* Deep copy of a snapshot, or an empty policy when old is NULL */
+struct usbguard_policy *policy_clone(const struct usbguard_policy *old)
+{
+    struct usbguard_policy *pol;
+    struct usbguard_port *port, *copy;
+    struct usbguard_view *view, *vcopy;
+    int bkt;
+
+    pol = kzalloc(sizeof(*pol), GFP_KERNEL);
+    if (!pol) return NULL;
+    hash_init(pol->ports);
+    hash_init(pol->views);
+    if (!old) return pol;
+
+    pol->seq = old->seq;
+    pol->generation = old->generation;
+    if (ruleset_copy(&pol->rules, &old->rules) ||
+        fp_set_copy(&pol->fingerprints, &old->fingerprints) ||
+        serial_set_copy(&pol->serials, &old->serials) ||
+        grant_list_copy(&pol->grants, &old->grants))
+        goto fail;
+    if (old->nr_quotas) {
+        pol->quotas = kmemdup(old->quotas, old->nr_quotas * sizeof(*old->quotas), GFP_KERNEL);
+        if (!pol->quotas) goto fail;
+        pol->nr_quotas = old->nr_quotas;
+    }
+
+    hash_for_each(old->ports, bkt, port, node) {
+        copy = kmemdup(port, sizeof(*port), GFP_KERNEL);
+        if (!copy) goto fail;
+        if (ruleset_copy(&copy->rules, &port->rules)) {
+            kfree(copy);
+            goto fail;
+        }
+        hash_add(pol->ports, &copy->node, port_hash(copy->name, strlen(copy->name)));
+    }
+
+    hash_for_each(old->views, bkt, view, node) {
+        vcopy = kmemdup(view, sizeof(*view), GFP_KERNEL);
+        if (!vcopy) goto fail;
+        if (ruleset_copy(&vcopy->rules, &view->rules)) {
+            kfree(vcopy);
+            goto fail;
+        }
+        hash_add(pol->views, &vcopy->node, vcopy->ns);
+        pol->nr_views++;
+    }
+    return pol;
+
+fail:
+    policy_free(pol);
+    return NULL;
+}
+
+/* fp_set_match() without counting a hit */
+static bool fp_set_has(const struct fp_set *set, u64 fp)
+{
+    u32 i;
+
+    for (i = fp & set->mask; set->count && set->slots[i]; i = (i + 1) & set->mask)
+        if (set->slots[i] == fp) return true;
+    return false;
+}
+
+static bool ruleset_equal(const struct ruleset *a, const struct ruleset *b)
+{
+    return a->count == b->count &&
+           !memcmp(a->ranges, b->ranges, a->count * sizeof(*a->ranges));
+}
+
+static bool ports_equal(const struct usbguard_policy *a, const struct usbguard_policy *b)
+{
+    struct usbguard_port *port, *other;
+    u32 na = 0, nb = 0;
+    int bkt;
+
+    hash_for_each(a->ports, bkt, port, node) {
+        other = port_lookup(b, port->name, strlen(port->name));
+        if (!other || other->ns != port->ns || !ruleset_equal(&port->rules, &other->rules))
+            return false;
+        na++;
+    }
+    hash_for_each(b->ports, bkt, port, node)
+        nb++;
+    return na == nb;
+}
+
+static bool views_equal(const struct usbguard_policy *a, const struct usbguard_policy *b)
+{
+    struct usbguard_view *view, *other;
+    int bkt;
+
+    if (a->nr_views != b->nr_views) return false;
+    hash_for_each(a->views, bkt, view, node) {
+        other = view_lookup(b, view->ns);
+        if (!other || other->nr_ports != view->nr_ports ||
+            !ruleset_equal(&view->rules, &other->rules))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Whether two snapshots enforce the same policy. Table order does not
+ * matter and hit counters are ignored; seq is not compared.
+ */
+bool policy_equal(const struct usbguard_policy *a, const struct usbguard_policy *b)
+{
+    const struct serial_ref *ref;
+    const struct usbguard_grant *g;
+    const struct usbguard_quota *q;
+    u32 i;
+
+    if (a->generation != b->generation || !ruleset_equal(&a->rules, &b->rules) ||
+        a->fingerprints.count != b->fingerprints.count ||
+        a->serials.count != b->serials.count || a->grants.count != b->grants.count ||
+        a->nr_quotas != b->nr_quotas)
+        return false;
+    for (i = 0; a->fingerprints.count && i <= a->fingerprints.mask; i++)
+        if (a->fingerprints.slots[i] && !fp_set_has(&b->fingerprints, a->fingerprints.slots[i]))
+            return false;
+    serial_set_for_each(&a->serials, ref)
+        if (!serial_find(&b->serials, a->serials.arena + ref->off, ref->len))
+            return false;
+    for (i = 0; i < a->grants.count; i++) {
+        g = grant_find(&b->grants, &a->grants.items[i].rule);
+        if (!g || g->expires != a->grants.items[i].expires) return false;
+    }
+    for (i = 0; i < a->nr_quotas; i++) {
+        q = quota_find(b, a->quotas[i].port, a->quotas[i].class);
+        if (!q || q->max != a->quotas[i].max) return false;
+    }
+    return ports_equal(a, b) && views_equal(a, b);
+}
+
+#ifdef USBGUARD_DEBUG
+/*
+ * Check the table invariants the lookups rely on. Built with
+ * "make DEBUG=1", every snapshot is checked before it is published.
+ */
+int policy_check(const struct usbguard_policy *pol)
+{
+    struct usbguard_port *port;
+    struct usbguard_view *view;
+    u32 nr_views = 0;
+    int bkt, rc;
+
+    rc = ruleset_check(&pol->rules);
+    if (!rc) rc = ruleset_check(&pol->grants.set);
+    if (!rc && pol->grants.count > pol->grants.cap) rc = -EINVAL;
+    if (!rc && !pol->grants.count && pol->grants.set.count) rc = -EINVAL;
+    if (!rc) rc = fp_set_check(&pol->fingerprints);
+    if (!rc) rc = serial_set_check(&pol->serials);
+    hash_for_each(pol->ports, bkt, port, node) {
+        if (rc) break;
+        if (port->ns && !view_lookup(pol, port->ns)) rc = -EINVAL;
+        else rc = port->rules.count || port->ns ? ruleset_check(&port->rules) : -EINVAL;
+    }
+    hash_for_each(pol->views, bkt, view, node) {
+        if (rc) break;
+        nr_views++;
+        rc = view->rules.count || view->nr_ports ? ruleset_check(&view->rules) : -EINVAL;
+    }
+    if (!rc && nr_views != pol->nr_views) rc = -EINVAL;
+    if (!rc && pol->nr_quotas > MAX_QUOTAS) rc = -EINVAL;
+    return rc;
+}
+#endif
+
+static size_t snapshot_size(const struct usbguard_policy *pol, u32 *nr_ports)
+{
+    size_t len = sizeof(struct snapshot_header);
+    const struct serial_ref *ref;
+    struct usbguard_port *port;
+    int bkt;
+
+    len += pol->fingerprints.count * sizeof(__le64);
+    len += pol->rules.count * sizeof(struct snapshot_range);
+    *nr_ports = 0;
+    hash_for_each(pol->ports, bkt, port, node) {
+        len += sizeof(struct snapshot_port) + port->rules.count * sizeof(struct snapshot_range);
+        (*nr_ports)++;
+    }
+    serial_set_for_each(&pol->serials, ref)
+        len += sizeof(__le32) + ALIGN(ref->len, 4);
+    return len + sizeof(__le32) + pol->nr_quotas * sizeof(struct snapshot_quota);
+}
+
+static void *snapshot_put_ranges(void *p, const struct ruleset *set)
+{
+    struct snapshot_range *out = p;
+    size_t i;
+
+    for (i = 0; i < set->count; i++) {
+        out[i].lo = cpu_to_le32(set->ranges[i].lo);
+        out[i].hi = cpu_to_le32(set->ranges[i].hi);
+    }
+    return out + set->count;
+}
+
+/* Serialize a policy into a new snapshot image (kvfree it) */
+void *policy_export(const struct usbguard_policy *pol, size_t *lenp)
+{
+    const struct serial_ref *ref;
+    struct snapshot_header *hdr;
+    struct usbguard_port *port;
+    u32 nr_ports, i;
+    size_t len;
+    void *p;
+    int bkt;
+
+    len = snapshot_size(pol, &nr_ports);
+    hdr = kvzalloc(len, GFP_KERNEL);
+    if (!hdr) return NULL;
+    p = hdr + 1;
+
+    for (i = 0; pol->fingerprints.slots && i <= pol->fingerprints.mask; i++) {
+        if (!pol->fingerprints.slots[i]) continue;
+        *(__le64 *)p = cpu_to_le64(pol->fingerprints.slots[i]);
+        p += sizeof(__le64);
+    }
+    p = snapshot_put_ranges(p, &pol->rules);
+    hash_for_each(pol->ports, bkt, port, node) {
+        struct snapshot_port *sp = p;
+
+        strscpy(sp->name, port->name, sizeof(sp->name));
+        sp->nr_ranges = cpu_to_le32(port->rules.count);
+        p = snapshot_put_ranges(sp + 1, &port->rules);
+    }
+    serial_set_for_each(&pol->serials, ref) {
+        *(__le32 *)p = cpu_to_le32(ref->len);
+        memcpy(p + sizeof(__le32), pol->serials.arena + ref->off, ref->len);
+        p += sizeof(__le32) + ALIGN(ref->len, 4);
+    }
+    *(__le32 *)p = cpu_to_le32(pol->nr_quotas);
+    p += sizeof(__le32);
+    for (i = 0; i < pol->nr_quotas; i++) {
+        struct snapshot_quota *sq = p;
+
+        strscpy(sq->port, pol->quotas[i].port, sizeof(sq->port));
+        sq->class = pol->quotas[i].class;
+        sq->max = cpu_to_le32(pol->quotas[i].max);
+        p = sq + 1;
+    }
+
+    hdr->magic = cpu_to_le32(SNAPSHOT_MAGIC);
+    hdr->version = cpu_to_le16(SNAPSHOT_VERSION);
+    hdr->generation = cpu_to_le64(pol->generation);
+    hdr->nr_fps = cpu_to_le32(pol->fingerprints.count);
+    hdr->nr_ranges = cpu_to_le32(pol->rules.count);
+    hdr->nr_ports = cpu_to_le32(nr_ports);
+    hdr->nr_serials = cpu_to_le32(pol->serials.count);
+    hdr->checksum = cpu_to_le64(xxh64(hdr + 1, len - sizeof(*hdr), 0));
+    *lenp = len;
+    return hdr;
+}
+
+/* Bounds-checked cursor over a snapshot image */
+struct snapshot_cursor {
+    const u8 *p;
+    size_t left;
+};
+
+static const void *snapshot_take(struct snapshot_cursor *c, size_t len)
+{
+    const void *p = c->p;
+
+    if (len > c->left || ALIGN(len, 4) > c->left) return NULL;
+    len = ALIGN(len, 4);
+    c->p += len;
+    c->left -= len;
+    return p;
+}
+
+static int snapshot_get_ranges(struct snapshot_cursor *c, struct ruleset *set, u32 n)
+{
+    const struct snapshot_range *r;
+    u32 i;
+    int rc;
+
+    r = snapshot_take(c, array_size(n, sizeof(*r)));
+    if (!r) return -EINVAL;
+    for (i = 0; i < n; i++) {
+        u32 lo = le32_to_cpu(r[i].lo), hi = le32_to_cpu(r[i].hi);
+
+        if (lo > hi || lo >> 16 != hi >> 16) return -EINVAL;
+        if (set && (rc = ruleset_add_range(set, lo, hi))) return rc;
+    }
+    return 0;
+}
+
+/*
+ * Check a snapshot image and, unless pol is NULL, merge it into pol.
+ * Callers check first so that a damaged image never half-applies.
+ */
+static int snapshot_walk(struct usbguard_policy *pol, const void *data, size_t size)
+{
+    struct snapshot_cursor c = { data, size };
+    const struct snapshot_header *hdr;
+    const __le64 *fps;
+    u32 i, n;
+    int rc;
+
+    hdr = snapshot_take(&c, sizeof(*hdr));
+    if (!hdr || le32_to_cpu(hdr->magic) != SNAPSHOT_MAGIC) return -EINVAL;
+    if (!hdr->version || le16_to_cpu(hdr->version) > SNAPSHOT_VERSION) return -EPROTONOSUPPORT;
+    if (!pol && xxh64(c.p, c.left, 0) != le64_to_cpu(hdr->checksum)) return -EBADMSG;
+
+    n = le32_to_cpu(hdr->nr_fps);
+    fps = snapshot_take(&c, array_size(n, sizeof(*fps)));
+    if (!fps) return -EINVAL;
+    for (i = 0; i < n; i++) {
+        if (!fps[i]) return -EINVAL;
+        if (pol && (rc = fp_set_add(&pol->fingerprints, le64_to_cpu(fps[i])))) return rc;
+    }
+
+    rc = snapshot_get_ranges(&c, pol ? &pol->rules : NULL, le32_to_cpu(hdr->nr_ranges));
+    if (rc) return rc;
+
+    for (i = 0; i < le32_to_cpu(hdr->nr_ports); i++) {
+        const struct snapshot_port *sp = snapshot_take(&c, sizeof(*sp));
+        struct usbguard_port *port = NULL;
+
+        if (!sp || !sp->name[0] || !memchr(sp->name, '\0', sizeof(sp->name)))
+            return -EINVAL;
+        if (pol) {
+            port = port_get(pol, sp->name);
+            if (IS_ERR(port)) return PTR_ERR(port);
+        }
+        rc = snapshot_get_ranges(&c, port ? &port->rules : NULL, le32_to_cpu(sp->nr_ranges));
+        if (port) port_put(port);
+        if (rc) return rc;
+    }
+
+    for (i = 0; i < le32_to_cpu(hdr->nr_serials); i++) {
+        const __le32 *len = snapshot_take(&c, sizeof(*len));
+        const char *serial;
+
+        if (!len) return -EINVAL;
+        n = le32_to_cpu(*len);
+        serial = snapshot_take(&c, n);
+        if (!serial || !n || memchr(serial, '\0', n)) return -EINVAL;
+        if (pol && (rc = serial_block(pol, serial, n))) return rc;
+    }
+
+    /* namespace inodes do not survive a reboot: old view sections are skipped */
+    if (le16_to_cpu(hdr->version) >= 4 && hdr->nr_views) return -EINVAL;
+    for (i = 0; i < le16_to_cpu(hdr->nr_views); i++) {
+        const struct snapshot_view *sv = snapshot_take(&c, sizeof(*sv));
+        const char *name;
+
+        if (!sv || !sv->ns) return -EINVAL;
+        rc = snapshot_get_ranges(&c, NULL, le32_to_cpu(sv->nr_ranges));
+        if (rc) return rc;
+        for (n = 0; n < le32_to_cpu(sv->nr_ports); n++) {
+            name = snapshot_take(&c, PORT_NAME_MAX);
+            if (!name || !name[0] || !memchr(name, '\0', PORT_NAME_MAX)) return -EINVAL;
+        }
+    }
+
+    if (le16_to_cpu(hdr->version) >= 3) {
+        const __le32 *nr = snapshot_take(&c, sizeof(*nr));
+
+        if (!nr) return -EINVAL;
+        for (i = 0; i < le32_to_cpu(*nr); i++) {
+            const struct snapshot_quota *sq = snapshot_take(&c, sizeof(*sq));
+
+            if (!sq || !memchr(sq->port, '\0', sizeof(sq->port))) return -EINVAL;
+            if (pol && (rc = quota_set(pol, sq->port, sq->class, le32_to_cpu(sq->max))))
+                return rc;
+        }
+    }
+
+    if (c.left) return -EINVAL;
+    if (pol)
+        pol->generation = max(pol->generation, le64_to_cpu(hdr->generation));
+    return 0;
+}
+
+/* Merge a snapshot image into an unpublished policy */
+int policy_import(struct usbguard_policy *pol, const void *data, size_t size)
+{
+    int rc = snapshot_walk(NULL, data, size);
+
+    return rc ? rc : snapshot_walk(pol, data, size);
+}
+
+struct blob_ctx {
+    struct usbguard_policy *pol;
+    const char *origin;
+    int rc;
+};
+
+/* Bad lines are skipped; the first ENOMEM or ENOSPC fails the blob */
+static int blob_line(void *arg, char *line)
+{
+    struct blob_ctx *bc = arg;
+    int rc;
+
+    if (bc->rc) return bc->rc;
+    rc = apply_rule_line(bc->pol, line, bc->origin);
+    if (rc == -ENOMEM || rc == -ENOSPC) bc->rc = rc;
+    return rc;
+}
+
+/* Apply every line of a rules blob to an unpublished policy */
+static int apply_rules_blob(struct usbguard_policy *pol, const char *data, size_t size,
+                            const char *origin)
+{
+    struct blob_ctx bc = { pol, origin, 0 };
+    u32 skipped = apply_blob_lines(data, size, blob_line, &bc);
+
+    if (skipped)
+        pr_info("usbguard: skipped %u overlong %s rule lines\n", skipped, origin);
+    return bc.rc;
+}
+
+/*
+ * Apply text rules, or a binary snapshot recognized by its magic. On an
+ * error the policy may hold part of the blob, so callers apply it to a
+ * copy and drop the copy.
+ */
+int apply_policy_blob(struct usbguard_policy *pol, const void *data, size_t size,
+                             const char *origin)
+{
+    if (size >= sizeof(struct snapshot_header) &&
+        le32_to_cpu(*(const __le32 *)data) == SNAPSHOT_MAGIC)
+        return policy_import(pol, data, size);
+    return apply_rules_blob(pol, data, size, origin);
+}
@@ -0,0 +1,271 @@
+/*
+ * usbguard_core.h - policy tables shared by the module and userspace tools
+ *
+ * The rule parser, the VID/PID range tables, the fingerprint set, the
+ * blocked serial set and the policy snapshots built from them, with their
+ * line dispatch and binary image format, build both in the kernel and in
+ * userspace; kernel APIs they need come from usbguard_shim.h.
+ */
+#ifndef USBGUARD_CORE_H
+#define USBGUARD_CORE_H
+
+#include "usbguard_shim.h"
+
+#define MAX_RULES 4096
+#define MAX_SERIALS MAX_RULES
+#define FP_SET_MIN 64
+#define SERIAL_INDEX_MIN 16
+#define BLOOM_BLOCK_BITS 512    /* one cache line */
+#define BLOOM_BITS_PER_SERIAL 16
+#define BLOOM_HASHES 8
+#define MASK_RANGES_MAX 256
+#define RULE_LINE_MAX 128
+#define PORT_NAME_MAX 32
+#define PORT_HASH_BITS 6
+#define VIEW_HASH_BITS 4
+#define MAX_VIEWS 1024
+#define MAX_GRANTS MAX_RULES
+#define GRANT_TTL_MAX (30 * 24 * 3600)  /* seconds */
+#define MAX_QUOTAS 64
+#define SNAPSHOT_MAGIC 0x53504755 /* "UGPS" */
+#define SNAPSHOT_VERSION 4     /* 2 adds views, 3 quotas, 4 drops views; older images still load */
+
+/* Parsed VID/PID rule: PIDs pid..pid_hi whose bits under mask match */
+struct vidpid {
+    u16 vid;
+    u16 pid;
+    u16 pid_hi;
+    u16 mask;
+};
+
+/* Inclusive range of (VID << 16 | PID) keys */
+struct vidpid_range {
+    u32 lo;
+    u32 hi;
+};
+
+/* Sorted, disjoint ranges; touching ranges of one VID are merged */
+struct ruleset {
+    struct vidpid_range *ranges;
+    atomic_long_t *hits;        /* parallel to ranges */
+    size_t count;
+    size_t cap;
+};
+
+/* Open-addressed set of descriptor fingerprints, 0 marks an empty slot */
+struct fp_set {
+    u64 *slots;
+    atomic_long_t *hits;        /* parallel to slots */
+    u32 mask;
+    u32 count;
+};
+
+/* Where one serial sits in the arena; len 0 marks a removed one */
+struct serial_ref {
+    u32 off;
+    u32 len;
+    u64 hash;
+    atomic_long_t hits;
+};
+
+/*
+ * Blocked serials of one snapshot. The strings are packed back to back in
+ * one arena and found through an open-addressed index whose slots hold a
+ * ref number + 1 (0 marks an empty slot). A blocked Bloom filter in front
+ * of the index answers most "not blocked" lookups from one cache line.
+ * Removal only marks the ref; once removed refs outnumber the live ones
+ * the set is rebuilt without them.
+ */
+struct serial_set {
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+    struct serial_ref *refs;
+    u32 count;          /* live serials */
+    u32 nr_refs;        /* refs in use, removed ones included */
+    u32 refs_cap;
+    u32 *index;
+    u32 mask;
+    unsigned long *bloom;
+    u32 bloom_blocks;
+};
+
+/* Rules that only apply to devices on one port (sysfs name, e.g. "1-1.2") */
+struct usbguard_port {
+    struct hlist_node node;
+    char name[PORT_NAME_MAX];
+    u32 ns;             /* namespace whose view applies below this port, or 0 */
+    struct ruleset rules;
+};
+
+/*
+ * Per-namespace overlay: devices below a port bound to a user namespace
+ * (by its inode number) must pass the global policy and also match the
+ * view's rules. Only the overlay is stored; the global tables are shared.
+ */
+struct usbguard_view {
+    struct hlist_node node;
+    u32 ns;
+    u32 nr_ports;       /* ports bound to this view */
+    struct ruleset rules;
+};
+
+/* At most max devices with an interface of class below port ("" for anywhere) */
+struct usbguard_quota {
+    char port[PORT_NAME_MAX];
+    u8 class;
+    u32 max;
+};
+
+/* Temporary VID/PID rule, dropped by the grant sweeper once it expires */
+struct usbguard_grant {
+    struct vidpid rule;
+    u64 expires;        /* jiffies64 */
+};
+
+/*
+ * Temporary rules. The list keeps each grant with its expiry; set is the
+ * merged ranges of all of them and is what probes match against.
+ */
+struct grant_list {
+    struct usbguard_grant *items;
+    u32 count;
+    u32 cap;
+    struct ruleset set;
+};
+
+/*
+ * Policy snapshot. Readers only look at it under rcu_read_lock(); writers
+ * copy the current snapshot under rules_lock, modify the copy and publish
+ * it, so one write (or one diff) becomes visible as a whole.
+ */
+struct usbguard_policy {
+    u64 seq;            /* bumped on every publish, invalidates cached verdicts */
+    u64 generation;     /* policy version set by diff pushes */
+    struct ruleset rules;
+    struct fp_set fingerprints;
+    DECLARE_HASHTABLE(ports, PORT_HASH_BITS);       /* keyed by port name */
+    DECLARE_HASHTABLE(views, VIEW_HASH_BITS);       /* keyed by namespace */
+    u32 nr_views;
+    struct grant_list grants;
+    struct usbguard_quota *quotas;
+    u32 nr_quotas;
+    struct serial_set serials;
+    struct rcu_head rcu;
+};
+
+/*
+ * Binary policy snapshot, little-endian and 4-byte aligned throughout:
+ * header, fingerprints, global ranges, ports (each followed by its
+ * ranges), serials (__le32 length, bytes padded to 4), then a __le32
+ * quota count and the quotas. Versions 2 and 3 also had views (each
+ * followed by its ranges and bound port names) before the quotas; they
+ * key on namespace inodes, which a reboot changes, so import skips them. The checksum is xxh64 over everything after the header.
+ */
+struct snapshot_header {
+    __le32 magic;
+    __le16 version;
+    __le16 nr_views;    /* only in versions 2 and 3, else 0 */
+    __le64 generation;
+    __le64 checksum;
+    __le32 nr_fps;
+    __le32 nr_ranges;
+    __le32 nr_ports;
+    __le32 nr_serials;
+};
+
+struct snapshot_range {
+    __le32 lo;
+    __le32 hi;
+};
+
+struct snapshot_port {
+    char name[PORT_NAME_MAX];
+    __le32 nr_ranges;
+};
+
+struct snapshot_view {
+    __le32 ns;
+    __le32 nr_ranges;
+    __le32 nr_ports;
+};
+
+struct snapshot_quota {
+    char port[PORT_NAME_MAX];
+    u8 class;
+    u8 reserved[3];
+    __le32 max;
+};
+
+/* Grow a kvmalloc'ed buffer, keeping its contents */
+void *kv_grow(void *old, size_t old_size, size_t new_size);
+
+/* Rule parsing; the line is split in place */
+char *trim(char *s);
+char *next_token(char **s);
+int parse_vidpid_line(char *line, struct vidpid *rule);
+int parse_fingerprint_line(char *line, u64 *fp);
+int apply_lines(char *buf, size_t count, int (*apply)(void *arg, char *line), void *arg,
+                size_t *done, size_t *accepted);
+u32 apply_blob_lines(const char *data, size_t size, int (*apply)(void *arg, char *line),
+                     void *arg);
+
+/* Fingerprint set */
+bool fp_set_match(const struct fp_set *set, u64 fp);
+int fp_set_add(struct fp_set *set, u64 fp);
+bool fp_set_remove(struct fp_set *set, u64 fp);
+void fp_set_free(struct fp_set *set);
+int fp_set_copy(struct fp_set *dst, const struct fp_set *src);
+
+/* VID/PID range tables */
+bool ruleset_match(const struct ruleset *set, u32 key);
+int ruleset_add_range(struct ruleset *set, u32 lo, u32 hi);
+int ruleset_update(struct ruleset *set, const struct vidpid *rule, bool remove);
+void ruleset_free(struct ruleset *set);
+int ruleset_copy(struct ruleset *dst, const struct ruleset *src);
+
+/* Blocked serial set */
+#define serial_set_for_each(set, ref) \
+    for (ref = (set)->refs; ref < (set)->refs + (set)->nr_refs; ref++) \
+        if (!ref->len) {} else
+
+struct serial_ref *serial_find(const struct serial_set *set, const char *s, size_t len);
+int serial_set_add(struct serial_set *set, const char *s, size_t len);
+void serial_set_free(struct serial_set *set);
+int serial_set_remove(struct serial_set *set, struct serial_ref *victim);
+int serial_set_copy(struct serial_set *dst, const struct serial_set *src);
+
+/* Policy snapshots; apply_*() only modify a policy that is not published */
+u32 port_hash(const char *name, size_t len);
+struct usbguard_port *port_lookup(const struct usbguard_policy *pol, const char *name,
+                                  size_t len);
+size_t port_parent(const char *name, size_t len);
+struct usbguard_view *view_lookup(const struct usbguard_policy *pol, u32 ns);
+int grants_expire(struct grant_list *gl, u64 now, u32 *expired);
+u64 grants_next(const struct grant_list *gl);
+int grant_list_copy(struct grant_list *dst, const struct grant_list *src);
+int apply_rule_line(struct usbguard_policy *pol, char *line, const char *origin);
+int apply_serial_line(struct usbguard_policy *pol, char *line, bool remove);
+int apply_blocked_line(struct usbguard_policy *pol, char *line);
+int apply_diff_line(struct usbguard_policy *pol, char *line);
+int apply_policy_blob(struct usbguard_policy *pol, const void *data, size_t size,
+                      const char *origin);
+void policy_free(struct usbguard_policy *pol);
+struct usbguard_policy *policy_clone(const struct usbguard_policy *old);
+bool policy_equal(const struct usbguard_policy *a, const struct usbguard_policy *b);
+void *policy_export(const struct usbguard_policy *pol, size_t *lenp);
+int policy_import(struct usbguard_policy *pol, const void *data, size_t size);
+
+#ifdef USBGUARD_DEBUG
+int ruleset_check(const struct ruleset *set);
+int fp_set_check(const struct fp_set *set);
+int serial_set_check(const struct serial_set *set);
+int policy_check(const struct usbguard_policy *pol);
+#else
+static inline int policy_check(const struct usbguard_policy *pol)
+{
+    return 0;
+}
+#endif
+
+#endif /* USBGUARD_CORE_H */
@@ -0,0 +1,247 @@
+/*
+ * usbguard_fuzz.c - libFuzzer harnesses for the policy parsers
+ *
+ * Builds usbguard_core.c outside the kernel (make usbguard-fuzz, needs
+ * clang). The default target feeds each input to the line dispatch the
+ * module uses: apply_diff_line() through apply_blob_lines() as for a
+ * policy diff or rules file, and apply_rule_line() and
+ * apply_blocked_line() through apply_lines() as for sysfs writes, so
+ * port, view, quota, ttl= and serial lines all reach the real code.
+ * With -DUSBGUARD_FUZZ_SNAPSHOT (make usbguard-fuzz-snapshot) each input
+ * is a snapshot image for policy_import() instead; the checksum is fixed
+ * up first so that mutations get past it to the section parsers.
+ *
+ * Every policy that comes out is checked against its invariants and must
+ * export to an image that imports again.
+ *
+ * With -DUSBGUARD_FUZZ_STANDALONE (make fuzz-smoke) a small driver takes
+ * the place of libFuzzer, so both targets also run under gcc: it replays
+ * the files given, then feeds random inputs built from rule tokens or
+ * mutated images.
+ *
+ * Usage: usbguard-fuzz [libFuzzer options] [corpus dir...]
+ *        usbguard-fuzz-smoke [-runs=N] [-seed=N] [file...]
+ */
+#include <stdio.h>
+
+#include "usbguard_core.h"
+
+#define FUZZ_INPUT_MAX (64 * 1024)
+
+static void fuzz_fail(const char *what, int rc)
+{
+    fprintf(stderr, "usbguard-fuzz: %s (%d)\n", what, rc);
+    abort();
+}
+
+static void fuzz_check(const struct usbguard_policy *pol)
+{
+    int rc = policy_check(pol);
+
+    if (rc) fuzz_fail("policy invariant", rc);
+}
+
+/* A checked policy must survive an export and import unchanged in shape */
+static void fuzz_roundtrip(const struct usbguard_policy *pol)
+{
+    struct usbguard_policy *copy;
+    size_t len;
+    void *img;
+    int rc;
+
+    fuzz_check(pol);
+    img = policy_export(pol, &len);
+    if (!img) fuzz_fail("export failed", -ENOMEM);
+    copy = policy_clone(NULL);
+    if (!copy) fuzz_fail("clone failed", -ENOMEM);
+    rc = policy_import(copy, img, len);
+    if (rc) fuzz_fail("exported image does not import", rc);
+    fuzz_check(copy);
+    if (copy->rules.count != pol->rules.count ||
+        copy->fingerprints.count != pol->fingerprints.count ||
+        copy->serials.count != pol->serials.count ||
+        copy->nr_quotas != pol->nr_quotas)
+        fuzz_fail("imported policy differs from the exported one", 0);
+    policy_free(copy);
+    free(img);
+}
+
+static int diff_line(void *arg, char *line)
+{
+    return apply_diff_line(arg, line);
+}
+
+#ifndef USBGUARD_FUZZ_SNAPSHOT
+static int rules_line(void *arg, char *line)
+{
+    return apply_rule_line(arg, line, "fuzz");
+}
+
+static int blocked_line(void *arg, char *line)
+{
+    return apply_blocked_line(arg, line);
+}
+
+int LLVMFuzzerTestOneInput(const u8 *data, size_t size)
+{
+    int (*const split[])(void *, char *) = { rules_line, blocked_line };
+    struct usbguard_policy *pol;
+    size_t done, accepted;
+    char *buf;
+    int i;
+
+    if (size > FUZZ_INPUT_MAX) return 0;
+
+    /* policy diff / rules file / firmware blob: read-only, no terminator */
+    pol = policy_clone(NULL);
+    if (!pol) return 0;
+    apply_blob_lines((const char *)data, size, diff_line, pol);
+    fuzz_roundtrip(pol);
+    policy_free(pol);
+
+    /* sysfs writes: split in place, NUL-terminated like kmemdup_nul() */
+    pol = policy_clone(NULL);
+    buf = malloc(size + 1);
+    if (!pol || !buf) goto out;
+    for (i = 0; i < ARRAY_SIZE(split); i++) {
+        memcpy(buf, data, size);
+        buf[size] = '\0';
+        apply_lines(buf, size, split[i], pol, &done, &accepted);
+        if (done > size || accepted > done) fuzz_fail("apply_lines() overran the write", 0);
+    }
+    fuzz_roundtrip(pol);
+out:
+    policy_free(pol);
+    free(buf);
+    return 0;
+}
+#else
+int LLVMFuzzerTestOneInput(const u8 *data, size_t size)
+{
+    size_t off = offsetof(struct snapshot_header, checksum);
+    struct usbguard_policy *pol;
+    __le64 sum;
+    u8 *img;
+    int rc;
+
+    if (size > FUZZ_INPUT_MAX) return 0;
+    img = malloc(size ? size : 1);
+    pol = policy_clone(NULL);
+    if (!img || !pol) goto out;
+    memcpy(img, data, size);
+    if (size >= sizeof(struct snapshot_header)) {
+        sum = cpu_to_le64(xxh64(img + sizeof(struct snapshot_header),
+                                size - sizeof(struct snapshot_header), 0));
+        memcpy(img + off, &sum, sizeof(sum));
+    }
+
+    /* a failed import may leave part of the image merged, but never a broken table */
+    rc = policy_import(pol, img, size);
+    if (!rc) fuzz_roundtrip(pol);
+    else fuzz_check(pol);
+out:
+    policy_free(pol);
+    free(img);
+    return 0;
+}
+#endif
+
+#ifdef USBGUARD_FUZZ_STANDALONE
+#define FUZZ_RUNS 10000
+
+/* Rule syntax fragments the random lines are put together from */
+static const char * const fuzz_tokens[] = {
+    "1000", "0001", "00ff-0100", "0000/fff0", "ffff", "-", "+", "#", "@1-1", "@1-1.2",
+    "@", "%1", "%4026531837", "%0", "quota", "08", "03", "4", "ttl=5s", "ttl=2h", "ttl=",
+    "fp", "0123456789abcdef", "serial", "SN1", "SN2", "generation", "1", " ", "\t",
+};
+
+static size_t fuzz_random_lines(char *buf, size_t cap)
+{
+    size_t len = 0;
+    int n = random() % 64;
+
+    while (n-- > 0) {
+        const char *tok = fuzz_tokens[random() % ARRAY_SIZE(fuzz_tokens)];
+        size_t tlen = strlen(tok);
+
+        if (len + tlen + 2 > cap) break;
+        memcpy(buf + len, tok, tlen);
+        len += tlen;
+        buf[len++] = random() % 4 ? ' ' : '\n';
+    }
+    return len;
+}
+
+#ifdef USBGUARD_FUZZ_SNAPSHOT
+/* A valid image of a random policy, then a few flipped bytes or a cut */
+static size_t fuzz_random_input(u8 *buf, size_t cap)
+{
+    struct usbguard_policy *pol = policy_clone(NULL);
+    char text[4096];
+    size_t len = 0, n;
+    void *img;
+
+    if (!pol) return 0;
+    n = fuzz_random_lines(text, sizeof(text));
+    apply_blob_lines(text, n, diff_line, pol);
+    img = policy_export(pol, &len);
+    policy_free(pol);
+    if (!img) return 0;
+    len = min(len, cap);
+    memcpy(buf, img, len);
+    free(img);
+    for (n = random() % 4; n && len; n--)
+        buf[random() % len] ^= 1 << (random() % 8);
+    if (len && random() % 8 == 0)
+        len = random() % len;
+    return len;
+}
+#else
+static size_t fuzz_random_input(u8 *buf, size_t cap)
+{
+    size_t len = fuzz_random_lines((char *)buf, cap), n;
+
+    for (n = random() % 2; n && len; n--)
+        buf[random() % len] = random();
+    return len;
+}
+#endif
+
+static void fuzz_file(const char *path, u8 *buf)
+{
+    FILE *f = fopen(path, "rb");
+    size_t len;
+
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    len = fread(buf, 1, FUZZ_INPUT_MAX, f);
+    fclose(f);
+    LLVMFuzzerTestOneInput(buf, len);
+}
+
+int main(int argc, char **argv)
+{
+    static u8 buf[FUZZ_INPUT_MAX];
+    unsigned long runs = FUZZ_RUNS, seed = 1, i;
+    int files = 0, a;
+
+    for (a = 1; a < argc; a++) {
+        if (!strncmp(argv[a], "-runs=", 6))
+            runs = strtoul(argv[a] + 6, NULL, 0);
+        else if (!strncmp(argv[a], "-seed=", 6))
+            seed = strtoul(argv[a] + 6, NULL, 0);
+        else {
+            fuzz_file(argv[a], buf);
+            files++;
+        }
+    }
+    srandom(seed);
+    for (i = 0; i < runs; i++)
+        LLVMFuzzerTestOneInput(buf, fuzz_random_input(buf, sizeof(buf)));
+    printf("%s: seed %lu, %d files, %lu random inputs, no failures\n", argv[0], seed, files, runs);
+    return 0;
+}
+#endif
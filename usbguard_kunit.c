@@ -0,0 +1,264 @@
+/*
+ * usbguard_kunit.c - KUnit tests of the sysfs store path
+ *
+ * Included at the end of usbguard_main.c when built with "make KUNIT=1"
+ * against a kernel with CONFIG_KUNIT, and run when the module loads. The
+ * tests write through rules_store(), blocked_store() and policy_store()
+ * the way a sysfs write does. Each one starts from an empty policy; the
+ * policy and mode in place before the suite are put back after it. While
+ * the suite runs the module is in allow mode, so the empty policies never
+ * deconfigure a real device.
+ */
+#include <kunit/test.h>
+#include <linux/completion.h>
+
+#define KUNIT_WRITERS 2
+#define KUNIT_READERS 4
+#define KUNIT_WRITES 256        /* PIDs each writer adds, one write each */
+#define KUNIT_VID 0x7000        /* writer i adds to VID 7000 + i */
+
+static struct usbguard_policy *kunit_saved;
+static int kunit_saved_mode;
+
+typedef ssize_t (*kunit_store_fn)(struct kobject *, struct kobj_attribute *, const char *, size_t);
+
+/* 0 when the whole write was taken, else what the store returned */
+static ssize_t kunit_write(kunit_store_fn store, const char *text)
+{
+    ssize_t rc = store(NULL, NULL, text, strlen(text));
+
+    return rc == strlen(text) ? 0 : rc;
+}
+
+static int usbguard_kunit_suite_init(struct kunit_suite *suite)
+{
+    kunit_saved_mode = xchg(&usbguard_mode, MODE_ALLOW);
+    mutex_lock(&rules_lock);
+    kunit_saved = policy_begin();
+    mutex_unlock(&rules_lock);
+    return kunit_saved ? 0 : -ENOMEM;
+}
+
+static void usbguard_kunit_suite_exit(struct kunit_suite *suite)
+{
+    /* the mode first; the publish may be skipped, so ask for reeval too */
+    WRITE_ONCE(usbguard_mode, kunit_saved_mode);
+    mutex_lock(&rules_lock);
+    policy_publish(kunit_saved);
+    mutex_unlock(&rules_lock);
+    schedule_work(&reeval_work);
+    kunit_saved = NULL;
+}
+
+static int usbguard_kunit_init(struct kunit *test)
+{
+    struct usbguard_policy *pol = policy_clone(NULL);
+
+    if (!pol) return -ENOMEM;
+    mutex_lock(&rules_lock);
+    policy_publish(pol);
+    mutex_unlock(&rules_lock);
+    return 0;
+}
+
+/* Lines are applied in one publish; bad ones are skipped, not fatal */
+static void usbguard_kunit_rules(struct kunit *test)
+{
+    static const char text[] = "1000 0001\nbogus\n\n# c\n-1000 0001\n1000 0002-0004\n"
+                               "@1-1 2000 0001\n";
+    char *buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+    u64 seq = policy_seq();
+
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+    KUNIT_EXPECT_EQ(test, kunit_write(rules_store, text), 0);
+    KUNIT_EXPECT_EQ(test, policy_seq(), seq + 1);
+    rules_show(NULL, NULL, buf);
+    KUNIT_EXPECT_STREQ(test, buf, "1000 0002-0004\n@1-1 2000 0001\n");
+
+    /* a write that changes nothing publishes nothing */
+    KUNIT_EXPECT_EQ(test, kunit_write(rules_store, "1000 0003\n# again\n"), 0);
+    KUNIT_EXPECT_EQ(test, policy_seq(), seq + 1);
+
+    /* removing what is not there fails the line, not the write */
+    KUNIT_EXPECT_EQ(test, kunit_write(rules_store, "-3000 0001\n"), 0);
+    KUNIT_EXPECT_EQ(test, kunit_write(rules_store, "-1000 0003\n"), 0);
+    rules_show(NULL, NULL, buf);
+    KUNIT_EXPECT_STREQ(test, buf, "1000 0002\n1000 0004\n@1-1 2000 0001\n");
+}
+
+static void usbguard_kunit_blocked(struct kunit *test)
+{
+    char *buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+    KUNIT_EXPECT_EQ(test, kunit_write(blocked_store, "SN1\n  SN2  \nSN1\n"), 0);
+    KUNIT_EXPECT_EQ(test, kunit_write(blocked_store, "-SN1\n"), 0);
+    blocked_show(NULL, NULL, buf);
+    KUNIT_EXPECT_STREQ(test, buf, "SN2\n");
+}
+
+/* A diff applies as a whole or not at all, and generations only go up */
+static void usbguard_kunit_diff(struct kunit *test)
+{
+    static const char good[] = "generation 5\n+1000 0001\nserial SN1\n";
+    static const char bad[] = "generation 6\n+1000 0002\n-serial SN9\n";
+    char *buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+    u64 seq;
+
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+    KUNIT_EXPECT_EQ(test, kunit_write(policy_store, good), 0);
+    generation_show(NULL, NULL, buf);
+    KUNIT_EXPECT_STREQ(test, buf, "5\n");
+
+    seq = policy_seq();
+    KUNIT_EXPECT_EQ(test, kunit_write(policy_store, good), 0);
+    KUNIT_EXPECT_EQ(test, kunit_write(policy_store, "generation 4\n"), (ssize_t)-ESTALE);
+    KUNIT_EXPECT_EQ(test, kunit_write(policy_store, bad), (ssize_t)-ENOENT);
+    KUNIT_EXPECT_EQ(test, kunit_write(policy_store, "generation x\n"), (ssize_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, policy_seq(), seq);
+    rules_show(NULL, NULL, buf);
+    KUNIT_EXPECT_STREQ(test, buf, "1000 0001\n");
+}
+
+struct kunit_thread {
+    struct task_struct *task;
+    struct completion done;
+    unsigned int id;
+    unsigned long reads;
+    const char *fail;
+};
+
+/*
+ * Add PIDs 0, 1, 2... of the writer's VID one write at a time, with a
+ * blocked serial going back and forth in between for more contention on
+ * rules_lock. Writer 0 sends every 16th PID as a policy diff; only one
+ * writer does, since a diff that repeats the current generation is taken
+ * as already applied.
+ */
+static int kunit_writer_fn(void *data)
+{
+    struct kunit_thread *t = data;
+    u16 vid = KUNIT_VID + t->id;
+    char line[64];
+    ssize_t rc;
+    u64 gen;
+    u32 pid;
+
+    for (pid = 0; pid < KUNIT_WRITES && !t->fail; pid++) {
+        if (t->id == 0 && pid % 16 == 15) {
+            rcu_read_lock();
+            gen = rcu_dereference(policy)->generation;
+            rcu_read_unlock();
+            snprintf(line, sizeof(line), "generation %llu\n+%04x %04x\n", gen + 1, vid, pid);
+            rc = kunit_write(policy_store, line);
+        } else {
+            snprintf(line, sizeof(line), "%04x %04x\n", vid, pid);
+            rc = kunit_write(rules_store, line);
+        }
+        if (rc) t->fail = "write failed";
+        snprintf(line, sizeof(line), "%sKUNIT%u\n", pid & 1 ? "-" : "", t->id);
+        if (kunit_write(blocked_store, line)) t->fail = "serial write failed";
+    }
+    complete(&t->done);
+    while (!kthread_should_stop())
+        msleep(1);
+    return 0;
+}
+
+/* The PIDs a writer added so far, as seen in one snapshot */
+static u32 kunit_writer_count(const struct usbguard_policy *pol, unsigned int id)
+{
+    u32 key = (u32)(KUNIT_VID + id) << 16;
+    size_t i;
+
+    for (i = 0; i < pol->rules.count; i++)
+        if (pol->rules.ranges[i].lo == key)
+            return pol->rules.ranges[i].hi - key + 1;
+    return 0;
+}
+
+/* Snapshots must be consistent and never lose a write once seen */
+static int kunit_reader_fn(void *data)
+{
+    struct kunit_thread *t = data;
+    u32 seen[KUNIT_WRITERS] = {}, n;
+    const struct usbguard_policy *pol;
+    char *buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    unsigned int i;
+
+    while (!kthread_should_stop()) {
+        rcu_read_lock();
+        pol = rcu_dereference(policy);
+        if (policy_check(pol)) t->fail = "inconsistent snapshot";
+        for (i = 0; i < KUNIT_WRITERS; i++) {
+            n = kunit_writer_count(pol, i);
+            if (n < seen[i]) t->fail = "write undone";
+            seen[i] = n;
+        }
+        rcu_read_unlock();
+        if (buf) rules_show(NULL, NULL, buf);
+        t->reads++;
+        cond_resched();
+    }
+    kfree(buf);
+    return 0;
+}
+
+static void usbguard_kunit_concurrent(struct kunit *test)
+{
+    struct kunit_thread *w, *r;
+    const struct usbguard_policy *pol;
+    unsigned int i;
+
+    w = kunit_kcalloc(test, KUNIT_WRITERS, sizeof(*w), GFP_KERNEL);
+    r = kunit_kcalloc(test, KUNIT_READERS, sizeof(*r), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_NULL(test, w);
+    KUNIT_ASSERT_NOT_NULL(test, r);
+
+    for (i = 0; i < KUNIT_READERS; i++) {
+        r[i].task = kthread_run(kunit_reader_fn, &r[i], "usbguard-kr%u", i);
+        KUNIT_ASSERT_FALSE(test, IS_ERR(r[i].task));
+    }
+    for (i = 0; i < KUNIT_WRITERS; i++) {
+        w[i].id = i;
+        init_completion(&w[i].done);
+        w[i].task = kthread_run(kunit_writer_fn, &w[i], "usbguard-kw%u", i);
+        KUNIT_ASSERT_FALSE(test, IS_ERR(w[i].task));
+    }
+    for (i = 0; i < KUNIT_WRITERS; i++) {
+        wait_for_completion(&w[i].done);
+        kthread_stop(w[i].task);
+        KUNIT_EXPECT_NULL_MSG(test, w[i].fail, "writer %u: %s", i, w[i].fail);
+    }
+    for (i = 0; i < KUNIT_READERS; i++) {
+        kthread_stop(r[i].task);
+        KUNIT_EXPECT_NULL_MSG(test, r[i].fail, "reader %u: %s", i, r[i].fail);
+        KUNIT_EXPECT_GT(test, r[i].reads, 0UL);
+    }
+
+    /* no write was lost between concurrent writers */
+    rcu_read_lock();
+    pol = rcu_dereference(policy);
+    for (i = 0; i < KUNIT_WRITERS; i++)
+        KUNIT_EXPECT_EQ(test, kunit_writer_count(pol, i), (u32)KUNIT_WRITES);
+    KUNIT_EXPECT_EQ(test, pol->generation, (u64)(KUNIT_WRITES / 16));
+    rcu_read_unlock();
+}
+
+static struct kunit_case usbguard_kunit_cases[] = {
+    KUNIT_CASE(usbguard_kunit_rules),
+    KUNIT_CASE(usbguard_kunit_blocked),
+    KUNIT_CASE(usbguard_kunit_diff),
+    KUNIT_CASE(usbguard_kunit_concurrent),
+    {}
+};
+
+static struct kunit_suite usbguard_kunit_suite = {
+    .name = "usbguard",
+    .suite_init = usbguard_kunit_suite_init,
+    .suite_exit = usbguard_kunit_suite_exit,
+    .init = usbguard_kunit_init,
+    .test_cases = usbguard_kunit_cases,
+};
+
+kunit_test_suite(usbguard_kunit_suite);
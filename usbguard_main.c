@@ -0,0 +1,2320 @@
+/*
+ * USBGuard Kernel Module
+ *
+ * This module demonstrates USB device access control in Linux.
+ *
+ * Features:
+ * - Loads allowed USB device rules (VID/PID) from /etc/usbguard.rules and the
+ *   *.rules drop-ins in /etc/usbguard.rules.d (module parameters rules_path, rules_dir)
+ * - Supports dynamic modification via sysfs (/sys/usbguard/rules, /sys/usbguard/blocked_serials)
+ * - Checks device serial numbers against blocked list
+ * - Allows devices by a fingerprint of their descriptor set ("fp <hash>" rules)
+ * - Scopes VID/PID rules to a physical port and the ports below it ("@1-1.2 VID PID")
+ * - Narrows ports bound to a user namespace to that namespace's view ("%NS VID PID")
+ * - Grants temporary rules ("VID PID ttl=2h") expired in batches by one sweeper
+ * - Limits attached devices per interface class, globally or per port ("quota @1-1 08 1")
+ * - Accepts PID ranges ("VID LO-HI") and masks ("VID PID/MASK"), kept as merged ranges
+ * - Removes rules and blocked serials written with a leading '-'
+ * - Keeps the policy in RCU-published snapshots; diffs apply in one publish
+ * - Reloads the rules file on demand (/sys/kernel/usbguard/reload) with an atomic swap
+ * - Optionally takes the boot policy from a firmware blob (rules_firmware parameter)
+ * - Exports the compiled policy as a versioned binary snapshot that loads back without parsing
+ * - Counts hits per rule and blocked serial (debugfs usbguard/hits)
+ * - Lists attached devices with their latest verdict (debugfs usbguard/devices)
+ * - Re-checks attached devices after each policy change and deconfigures those no longer allowed
+ * - Runs in enforce, audit, allow or deny mode (mode parameter, /sys/kernel/usbguard/mode)
+ * - Shares its rule parser, tables and snapshot format (usbguard_core.c) with userspace tools
+ * - Logs all device connection attempts
+ *
+ * Notes:
+ * - This is a demo: it prevents the driver from binding but does not fully block device usage.
+ * - For production, the USB Authorization framework should be used.
+ *
+ * Author: pnasis
+ * License: GPL
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/usb.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/ctype.h>
+#include <linux/byteorder/generic.h>
+#include <linux/xxhash.h>
+#include <linux/xarray.h>
+#include <linux/notifier.h>
+#include <linux/rcupdate.h>
+#include <linux/hashtable.h>
+#include <linux/fs.h>
+#include <linux/kernel_read_file.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/bitmap.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/cpu.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/moduleparam.h>
+#include <linux/firmware.h>
+#include <linux/device.h>
+#include <linux/cred.h>
+#include <linux/user_namespace.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+
+#include "usbguard_core.h"
+
+#define RULES_FILE "/etc/usbguard.rules"
+#define RULES_DIR "/etc/usbguard.rules.d"
+#define MAX_DROPINS 64
+#define RULES_FILE_MAX (1 << 20)
+#define USB_CLASSES 256
+#define PROBE_HIST_BUCKETS 16   /* power-of-two microsecond buckets, the last one open-ended */
+#define REEVAL_BATCH 16         /* attached devices re-evaluated per pass over the table */
+
+/*
+ * Live device counts per interface class below one port; "" counts every
+ * device. Entries are created on first use and kept until module exit.
+ */
+struct port_count {
+    struct hlist_node node;
+    char name[PORT_NAME_MAX];
+    atomic_t devices[USB_CLASSES];
+};
+
+/* Outcome of the latest interface probe of a device */
+enum dev_verdict {
+    VERDICT_PENDING,
+    VERDICT_ACCEPTED,
+    VERDICT_AUDITED,
+    VERDICT_REJECTED,
+};
+
+static const char * const verdict_names[] = {
+    [VERDICT_PENDING] = "pending",
+    [VERDICT_ACCEPTED] = "accepted",
+    [VERDICT_AUDITED] = "audited",
+    [VERDICT_REJECTED] = "rejected",
+};
+
+/* Attached device with its cached verdict, keyed by bus/devnum */
+struct usbguard_dev {
+    u64 fingerprint;
+    u64 seq;            /* snapshot allowed was computed for, U64_MAX before the first */
+    bool allowed;
+    u8 verdict;         /* enum dev_verdict */
+    u16 vid, pid;
+    time64_t attached;
+    struct usb_device *udev;    /* only dereferenced under the xarray lock */
+    char port[PORT_NAME_MAX];
+    DECLARE_BITMAP(classes, USB_CLASSES);   /* interface classes counted for quotas */
+    struct rcu_head rcu;
+    char serial[];      /* "" when the device has none */
+};
+
+static struct usbguard_policy __rcu *policy;
+
+static DEFINE_XARRAY(devices);
+
+static DEFINE_HASHTABLE(port_counts, PORT_HASH_BITS);
+static DEFINE_SPINLOCK(port_counts_lock);     /* serializes adding port_counts */
+
+/* Serializes policy writers */
+static DEFINE_MUTEX(rules_lock);
+
+#ifdef USBGUARD_BENCH
+#define STRESS_BUS 1000             /* bus number of stress reader 0, above any real bus */
+
+/*
+ * Set under rules_lock while a stress run owns the live policy. Writes
+ * through sysfs (k set) are refused then, since the run puts its saved
+ * policy back at the end; in-kernel writers pass no kobject.
+ */
+static bool stress_running;
+/* Synthetic stress devices: their probes are not logged, re-evaluation skips them */
+/* Probes of synthetic stress devices are not logged */
+#define probe_quiet(udev) ((udev)->bus->busnum >= STRESS_BUS)
+#else
+#define stress_busy(k) ((void)(k), false)
+#define probe_quiet(udev) false
+#endif
+
+static struct kobject *usbguard_kobj;
+static struct dentry *usbguard_debugfs;
+
+/* Last exported snapshot image; protected by rules_lock */
+static struct {
+    void *data;
+    size_t len;
+    u64 seq;
+} snapshot_img;
+
+static char *rules_path = RULES_FILE;
+module_param(rules_path, charp, 0444);
+MODULE_PARM_DESC(rules_path, "Base rules file (default " RULES_FILE ")");
+
+static char *rules_dir = RULES_DIR;
+module_param(rules_dir, charp, 0444);
+MODULE_PARM_DESC(rules_dir, "Directory of *.rules drop-ins loaded in name order (default " RULES_DIR ")");
+
+static char *rules_firmware;
+module_param(rules_firmware, charp, 0444);
+MODULE_PARM_DESC(rules_firmware, "Firmware name of the boot policy, e.g. usbguard.rules (default: read rules_path)");
+
+/* Anchor device for request_firmware_nowait() */
+static struct device *fw_dev;
+
+/*
+ * Operating mode. enforce rejects what the policy does not allow, audit
+ * evaluates and logs but never rejects, allow and deny skip evaluation.
+ */
+enum usbguard_mode {
+    MODE_ENFORCE,
+    MODE_AUDIT,
+    MODE_ALLOW,
+    MODE_DENY,
+};
+
+static const char * const mode_names[] = {
+    [MODE_ENFORCE] = "enforce",
+    [MODE_AUDIT] = "audit",
+    [MODE_ALLOW] = "allow",
+    [MODE_DENY] = "deny",
+};
+
+static int usbguard_mode = MODE_ENFORCE;
+
+static int mode_set(const char *val)
+{
+    int mode = sysfs_match_string(mode_names, val);
+
+    if (mode < 0) return mode;
+    if (xchg(&usbguard_mode, mode) != mode)
+        pr_info("usbguard: mode %s\n", mode_names[mode]);
+    return 0;
+}
+
+static int mode_param_set(const char *val, const struct kernel_param *kp)
+{
+    return mode_set(val);
+}
+
+static int mode_param_get(char *buf, const struct kernel_param *kp)
+{
+    return sysfs_emit(buf, "%s\n", mode_names[READ_ONCE(usbguard_mode)]);
+}
+
+static const struct kernel_param_ops mode_param_ops = {
+    .set = mode_param_set,
+    .get = mode_param_get,
+};
+
+module_param_cb(mode, &mode_param_ops, NULL, 0644);
+MODULE_PARM_DESC(mode, "enforce, audit (log rejections but accept), allow or deny (default enforce)");
+
+/* Probe path counters, kept per CPU and summed by stats_show() */
+struct probe_stats {
+    u64 probes;
+    u64 rejected;
+    u64 audited;
+    u64 cached;
+    u64 ns;
+    u64 max_ns;
+    u64 hist[PROBE_HIST_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct probe_stats, probe_stats);
+
+static u32 device_key(struct usb_device *udev)
+{
+    return (u32)le16_to_cpu(udev->descriptor.idVendor) << 16 |
+           le16_to_cpu(udev->descriptor.idProduct);
+}
+
+/*
+ * Match device VID/PID against the global rules and the rules of the port
+ * the device sits on and every port above it ("1-1.2.3", "1-1.2", "1-1").
+ */
+static bool match_rules(const struct usbguard_policy *pol, struct usb_device *udev)
+{
+    const char *name = dev_name(&udev->dev);
+    size_t len = strlen(name);
+    u32 key = device_key(udev);
+    struct usbguard_port *port;
+    bool found;
+
+    found = ruleset_match(&pol->rules, key) ||
+            (pol->grants.count && ruleset_match(&pol->grants.set, key));
+    for (; !found && len; len = port_parent(name, len)) {
+        port = port_lookup(pol, name, len);
+        if (port)
+            found = ruleset_match(&port->rules, key);
+    }
+    return found;
+}
+
+/*
+ * A device below a port bound to a namespace must also match that
+ * namespace's view; the nearest bound port decides.
+ */
+static bool match_view(const struct usbguard_policy *pol, struct usb_device *udev)
+{
+    const char *name = dev_name(&udev->dev);
+    size_t len = strlen(name);
+    struct usbguard_port *port;
+    struct usbguard_view *view;
+
+    if (!pol->nr_views) return true;
+    for (; len; len = port_parent(name, len)) {
+        port = port_lookup(pol, name, len);
+        if (!port || !port->ns) continue;
+        view = view_lookup(pol, port->ns);
+        return view && ruleset_match(&view->rules, device_key(udev));
+    }
+    return true;
+}
+
+/* Check blocked serials, counting the hit */
+static bool serial_blocked(const struct usbguard_policy *pol, const char *s)
+{
+    struct serial_ref *ref;
+
+    if (!s || s[0] == '\0') return false;
+    ref = serial_find(&pol->serials, s, strlen(s));
+    if (!ref) return false;
+    atomic_long_inc(&ref->hits);
+    return true;
+}
+
+static void policy_free_rcu(struct rcu_head *head)
+{
+    policy_free(container_of(head, struct usbguard_policy, rcu));
+}
+
+/* Copy the live policy for modification; caller holds rules_lock */
+static struct usbguard_policy *policy_begin(void)
+{
+    return policy_clone(rcu_dereference_protected(policy, lockdep_is_held(&rules_lock)));
+}
+
+static void grant_sweep(struct work_struct *work);
+static DECLARE_DELAYED_WORK(grant_work, grant_sweep);
+static void reeval_devices(struct work_struct *work);
+static DECLARE_WORK(reeval_work, reeval_devices);
+static void quota_release(const char *name, u8 class);
+
+/*
+ * Arm the sweeper for the earliest grant expiry. The delay is rounded to
+ * a whole second so that grants expiring close together go in one sweep.
+ */
+static void grant_sweep_schedule(const struct grant_list *gl)
+{
+    u64 next, now = get_jiffies_64();
+
+    if (!gl->count) return;
+    next = grants_next(gl);
+    mod_delayed_work(system_wq, &grant_work,
+                     time_after64(next, now) ? round_jiffies_relative(next - now) : 0);
+}
+
+/*
+ * Publish a modified copy and retire the old snapshot; caller holds
+ * rules_lock. A copy that changes nothing is freed instead, so that a
+ * repeated write keeps the cached verdicts and does not wake reeval.
+ */
+static void policy_publish(struct usbguard_policy *pol)
+{
+    struct usbguard_policy *old;
+
+    WARN_ON_ONCE(policy_check(pol));
+    old = rcu_dereference_protected(policy, lockdep_is_held(&rules_lock));
+    if (old && policy_equal(old, pol)) {
+        policy_free(pol);
+        return;
+    }
+    pol->seq = old ? old->seq + 1 : 0;
+    rcu_assign_pointer(policy, pol);
+    if (old)
+        call_rcu(&old->rcu, policy_free_rcu);
+    grant_sweep_schedule(&pol->grants);
+    schedule_work(&reeval_work);
+}
+
+/* Remove all expired grants in a single publish */
+static void grant_sweep(struct work_struct *work)
+{
+    const struct usbguard_policy *cur;
+    struct usbguard_policy *pol;
+    u64 now = get_jiffies_64();
+    u32 expired;
+    int rc;
+
+    mutex_lock(&rules_lock);
+    cur = rcu_dereference_protected(policy, lockdep_is_held(&rules_lock));
+    if (!cur->grants.count || time_after64(grants_next(&cur->grants), now)) {
+        /* woke up early or for nothing; the next publish rearms us */
+        grant_sweep_schedule(&cur->grants);
+        mutex_unlock(&rules_lock);
+        return;
+    }
+
+    pol = policy_begin();
+    rc = pol ? grants_expire(&pol->grants, now, &expired) : -ENOMEM;
+    if (rc) {
+        policy_free(pol);
+        mod_delayed_work(system_wq, &grant_work, HZ);
+    } else {
+        policy_publish(pol);
+        pr_info("usbguard: %u temporary rules expired\n", expired);
+    }
+    mutex_unlock(&rules_lock);
+}
+
+static u64 policy_seq(void)
+{
+    u64 seq;
+
+    rcu_read_lock();
+    seq = rcu_dereference(policy)->seq;
+    rcu_read_unlock();
+    return seq;
+}
+
+/* Load rules from file into an unpublished policy, which is partly loaded on error */
+static int load_rules_from_file(struct usbguard_policy *pol, const char *path)
+{
+    void *buf = NULL;
+    ssize_t bytes;
+    int rc;
+
+    bytes = kernel_read_file_from_path(path, 0, &buf, RULES_FILE_MAX, NULL, READING_UNKNOWN);
+    if (bytes < 0) {
+        pr_err("usbguard: could not read rules file %s (%zd)\n", path, bytes);
+        return bytes;
+    }
+
+    rc = apply_policy_blob(pol, buf, bytes, "file");
+    vfree(buf);
+    if (rc)
+        pr_err("usbguard: could not load %s (%d)\n", path, rc);
+    return rc;
+}
+
+/* Names of the *.rules entries in the drop-in directory */
+struct dropin_list {
+    struct dir_context ctx;
+    char *names[MAX_DROPINS];
+    size_t count;
+    int rc;
+};
+
+static bool collect_dropin(struct dir_context *ctx, const char *name, int len,
+                           loff_t pos, u64 ino, unsigned int d_type)
+{
+    struct dropin_list *list = container_of(ctx, struct dropin_list, ctx);
+
+    if (d_type != DT_REG && d_type != DT_UNKNOWN) return true;
+    if (len <= 6 || memcmp(name + len - 6, ".rules", 6)) return true;
+    if (list->count >= MAX_DROPINS) {
+        pr_alert("usbguard: more than %d drop-ins in %s, ignoring %.*s\n",
+                 MAX_DROPINS, rules_dir, len, name);
+        return true;
+    }
+
+    list->names[list->count] = kstrndup(name, len, GFP_KERNEL);
+    if (!list->names[list->count]) {
+        list->rc = -ENOMEM;
+        return false;
+    }
+    list->count++;
+    return true;
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/*
+ * Load every *.rules file of the drop-in directory in name order, up to
+ * the first one that fails. A missing directory holds no drop-ins.
+ */
+static int load_rules_dir(struct usbguard_policy *pol)
+{
+    struct dropin_list *list;
+    struct file *dir;
+    size_t i;
+    int rc;
+
+    dir = filp_open(rules_dir, O_RDONLY | O_DIRECTORY, 0);
+    if (IS_ERR(dir)) {
+        rc = PTR_ERR(dir);
+        if (rc == -ENOENT) return 0;
+        pr_err("usbguard: could not open %s (%d)\n", rules_dir, rc);
+        return rc;
+    }
+
+    list = kzalloc(sizeof(*list), GFP_KERNEL);
+    if (!list) {
+        filp_close(dir, NULL);
+        return -ENOMEM;
+    }
+    list->ctx.actor = collect_dropin;
+    rc = iterate_dir(dir, &list->ctx);
+    filp_close(dir, NULL);
+    if (!rc) rc = list->rc;
+    if (rc) pr_err("usbguard: could not list %s (%d)\n", rules_dir, rc);
+
+    sort(list->names, list->count, sizeof(*list->names), cmp_names, NULL);
+    for (i = 0; i < list->count; i++) {
+        char *path = rc ? NULL : kasprintf(GFP_KERNEL, "%s/%s", rules_dir, list->names[i]);
+
+        if (path)
+            rc = load_rules_from_file(pol, path);
+        else if (!rc)
+            rc = -ENOMEM;
+        kfree(path);
+        kfree(list->names[i]);
+    }
+    kfree(list);
+    return rc;
+}
+
+/*
+ * Build a policy from the base rules file followed by the drop-ins. Callers
+ * load into a scratch copy and only publish it when every file loaded, so
+ * a bad file leaves the running policy as it was.
+ */
+static int load_policy(struct usbguard_policy *pol)
+{
+    int rc = load_rules_from_file(pol, rules_path);
+
+    return rc ? rc : load_rules_dir(pol);
+}
+
+/*
+ * Firmware callback: merge the blob into the live policy, or fall back to
+ * the rules files when no blob was found. Until this runs the policy only
+ * holds what was written through sysfs, which the merge keeps. Each
+ * attempt works on its own copy, so a blob or file that fails part way
+ * leaves nothing behind, and if neither loads the live policy stays.
+ */
+static void usbguard_fw_loaded(const struct firmware *fw, void *context)
+{
+    struct usbguard_policy *pol;
+    int rc = -ENOENT;
+
+    mutex_lock(&rules_lock);
+    if (fw) {
+        pol = policy_begin();
+        rc = pol ? apply_policy_blob(pol, fw->data, fw->size, "firmware") : -ENOMEM;
+        release_firmware(fw);
+        if (!rc) goto publish;
+        policy_free(pol);
+        pr_err("usbguard: firmware %s not usable (%d), reading %s\n",
+               rules_firmware, rc, rules_path);
+    } else {
+        pr_info("usbguard: firmware %s not found, reading %s\n", rules_firmware, rules_path);
+    }
+
+    pol = policy_begin();
+    rc = pol ? load_policy(pol) : -ENOMEM;
+    if (rc) {
+        pr_err("usbguard: boot policy not loaded (%d), keeping the current policy\n", rc);
+        policy_free(pol);
+        goto out;
+    }
+
+publish:
+    policy_publish(pol);
+out:
+    mutex_unlock(&rules_lock);
+}
+
+/* Ask for the boot policy without waiting for the root filesystem */
+static int request_policy_firmware(void)
+{
+    int rc;
+
+    fw_dev = root_device_register("usbguard");
+    if (IS_ERR(fw_dev)) {
+        rc = PTR_ERR(fw_dev);
+        fw_dev = NULL;
+        return rc;
+    }
+
+    rc = request_firmware_nowait(THIS_MODULE, FW_ACTION_UEVENT, rules_firmware,
+                                 fw_dev, GFP_KERNEL, NULL, usbguard_fw_loaded);
+    if (rc) {
+        root_device_unregister(fw_dev);
+        fw_dev = NULL;
+    }
+    return rc;
+}
+
+/* Hash the device descriptor and every raw configuration descriptor */
+static u64 device_fingerprint(struct usb_device *udev)
+{
+    struct xxh64_state state;
+    u64 fp;
+    int i;
+
+    xxh64_reset(&state, 0);
+    xxh64_update(&state, &udev->descriptor, sizeof(udev->descriptor));
+    for (i = 0; i < udev->descriptor.bNumConfigurations; i++) {
+        if (!udev->rawdescriptors || !udev->rawdescriptors[i])
+            continue;
+        xxh64_update(&state, udev->rawdescriptors[i],
+                     le16_to_cpu(udev->config[i].desc.wTotalLength));
+    }
+    fp = xxh64_digest(&state);
+    return fp ? fp : 1;
+}
+
+static unsigned long usbguard_dev_key(struct usb_device *udev)
+{
+    return ((unsigned long)udev->bus->busnum << 16) | udev->devnum;
+}
+
+/* Stub for interface class check */
+static bool check_interface_classes(struct usb_interface *interface)
+{
+    return true;
+}
+
+/*
+ * Evaluate VID/PID, fingerprint and serial rules for a device against one
+ * snapshot. Uses the serial string the USB core cached at enumeration so
+ * nothing here sleeps inside the RCU read section. Returns NULL when the
+ * device passes, else why it does not; the callers log.
+ */
+static const char *evaluate_device(struct usb_device *udev, u64 fp, u64 *seq)
+{
+    const struct usbguard_policy *pol;
+    const char *why = NULL;
+
+    rcu_read_lock();
+    pol = rcu_dereference(policy);
+    *seq = pol->seq;
+    if (!match_rules(pol, udev) && !fp_set_match(&pol->fingerprints, fp))
+        why = "VID/PID not allowed";
+    else if (serial_blocked(pol, udev->serial))
+        why = "blocked serial";
+    else if (!match_view(pol, udev))
+        why = "VID/PID not in the namespace view of its port";
+    rcu_read_unlock();
+    return why;
+}
+
+/*
+ * Look up the entry of an attached device, recording its identity on
+ * first sight. The fingerprint is left for the first evaluation, so the
+ * allow and deny modes never hash descriptors. Callers hold the device
+ * lock, which serializes them, and the entry is only dropped from the
+ * USB_DEVICE_REMOVE notifier.
+ */
+static struct usbguard_dev *usbguard_dev_get(struct usb_device *udev)
+{
+    unsigned long key = usbguard_dev_key(udev);
+    const char *serial = udev->serial ? udev->serial : "";
+    size_t len = strlen(serial);
+    struct usbguard_dev *dev;
+    int rc;
+
+    dev = xa_load(&devices, key);
+    if (dev) return dev;
+
+    dev = kzalloc(struct_size(dev, serial, len + 1), GFP_KERNEL);
+    if (!dev) return NULL;
+    dev->seq = U64_MAX;
+    /* until its first evaluation, an attached device counts as allowed */
+    dev->allowed = true;
+    dev->vid = le16_to_cpu(udev->descriptor.idVendor);
+    dev->pid = le16_to_cpu(udev->descriptor.idProduct);
+    dev->attached = ktime_get_real_seconds();
+    dev->udev = udev;
+    strscpy(dev->port, dev_name(&udev->dev), sizeof(dev->port));
+    memcpy(dev->serial, serial, len);
+
+    rc = xa_insert(&devices, key, dev, GFP_KERNEL);
+    if (rc) {
+        kfree(dev);
+        return NULL;
+    }
+    return dev;
+}
+
+/*
+ * Re-evaluate one attached device against the live policy under its
+ * device lock, which serializes this with its probes and its removal.
+ * A device that was allowed and no longer passes is deconfigured,
+ * unbinding every interface driver and giving back its quota charges;
+ * one that passes again is configured again, so its interfaces are
+ * probed anew. Only these transitions are logged.
+ */
+static void reeval_device(struct usb_device *udev, unsigned long key)
+{
+    int mode = READ_ONCE(usbguard_mode);
+    const char *name = dev_name(&udev->dev);
+    struct usbguard_dev *dev;
+    unsigned int class;
+    const char *why;
+    bool was;
+    int rc;
+
+    usb_lock_device(udev);
+    /* the stress run's devices are not registered, so there is nothing to configure */
+    if (udev->state == USB_STATE_NOTATTACHED || probe_quiet(udev))
+        goto out;
+
+    /* the entry is only erased under this device lock */
+    dev = xa_load(&devices, key);
+    /* devices none of whose interfaces reached the probe are not gated */
+    if (!dev || dev->udev != udev || dev->seq == policy_seq() ||
+        READ_ONCE(dev->verdict) == VERDICT_PENDING)
+        goto out;
+
+    was = dev->allowed;
+    if (dev->seq == U64_MAX)
+        WRITE_ONCE(dev->fingerprint, device_fingerprint(udev));
+    why = evaluate_device(udev, dev->fingerprint, &dev->seq);
+    dev->allowed = !why;
+    if (was == dev->allowed) goto out;
+
+    if (dev->allowed && READ_ONCE(dev->verdict) == VERDICT_AUDITED) {
+        /* only logged before, so nothing to undo */
+        pr_info("usbguard: audit: %s allowed again\n", name);
+        WRITE_ONCE(dev->verdict, VERDICT_ACCEPTED);
+    } else if (dev->allowed) {
+        /* the interface probes give the verdict; a failure is retried on the next publish */
+        pr_info("usbguard: %s allowed again, configuring device\n", name);
+        WRITE_ONCE(dev->verdict, VERDICT_PENDING);
+        rc = udev->descriptor.bNumConfigurations ?
+             usb_set_configuration(udev, udev->config[0].desc.bConfigurationValue) : -ENODEV;
+        if (rc) {
+            pr_err("usbguard: %s not configured (%d)\n", name, rc);
+            dev->allowed = false;
+            WRITE_ONCE(dev->verdict, VERDICT_REJECTED);
+        }
+    } else if (mode == MODE_AUDIT) {
+        pr_alert("usbguard: audit: %s no longer allowed (%s), would deconfigure device\n",
+                 name, why);
+        WRITE_ONCE(dev->verdict, VERDICT_AUDITED);
+    } else {
+        pr_alert("usbguard: %s no longer allowed (%s), deconfiguring device\n", name, why);
+        WRITE_ONCE(dev->verdict, VERDICT_REJECTED);
+        usb_set_configuration(udev, -1);
+        for_each_set_bit(class, dev->classes, USB_CLASSES)
+            quota_release(name, class);
+        bitmap_zero(dev->classes, USB_CLASSES);
+    }
+out:
+    usb_unlock_device(udev);
+}
+
+/*
+ * Re-check attached devices after a publish, REEVAL_BATCH at a time. Each
+ * batch takes a reference on its devices under the xarray lock, which the
+ * remove notifier also takes, and then drops it to lock each device in
+ * turn. Publishes that land while this runs queue one more pass.
+ */
+static void reeval_devices(struct work_struct *work)
+{
+    struct usb_device *batch[REEVAL_BATCH];
+    unsigned long keys[REEVAL_BATCH];
+    unsigned long key, next = 0;
+    struct usbguard_dev *dev;
+    unsigned int i, n;
+    int mode;
+
+    do {
+        mode = READ_ONCE(usbguard_mode);
+        if (mode != MODE_ENFORCE && mode != MODE_AUDIT) return;
+
+        n = 0;
+        xa_lock(&devices);
+        xa_for_each_start(&devices, key, dev, next) {
+            batch[n] = usb_get_dev(dev->udev);
+            keys[n] = key;
+            if (++n == REEVAL_BATCH) break;
+        }
+        xa_unlock(&devices);
+
+        for (i = 0; i < n; i++) {
+            reeval_device(batch[i], keys[i]);
+            usb_put_dev(batch[i]);
+        }
+        if (n) next = keys[n - 1] + 1;
+        cond_resched();
+    } while (n == REEVAL_BATCH);
+}
+
+/* Counter of a port prefix of length len ("" when len is 0), created on demand */
+static struct port_count *port_count_get(const char *name, size_t len)
+{
+    struct port_count *pc, *new;
+    u32 hash;
+
+    len = min_t(size_t, len, PORT_NAME_MAX - 1);
+    hash = port_hash(name, len);
+    rcu_read_lock();
+    hash_for_each_possible_rcu(port_counts, pc, node, hash)
+        if (strlen(pc->name) == len && !memcmp(pc->name, name, len))
+            goto out;
+    rcu_read_unlock();
+
+    new = kzalloc(sizeof(*new), GFP_KERNEL);
+    if (!new) return NULL;
+    memcpy(new->name, name, len);
+
+    spin_lock(&port_counts_lock);
+    rcu_read_lock();
+    hash_for_each_possible_rcu(port_counts, pc, node, hash)
+        if (strlen(pc->name) == len && !memcmp(pc->name, name, len))
+            break;
+    if (!pc) {
+        hash_add_rcu(port_counts, &new->node, hash);
+        pc = new;
+        new = NULL;
+    }
+    spin_unlock(&port_counts_lock);
+    kfree(new);
+out:
+    rcu_read_unlock();
+    return pc;
+}
+
+/* Smallest quota for class on the port prefix of length len */
+static u32 quota_limit(const struct usbguard_policy *pol, const char *name, size_t len, u8 class)
+{
+    u32 i, max = U32_MAX;
+
+    for (i = 0; i < pol->nr_quotas; i++) {
+        const struct usbguard_quota *q = &pol->quotas[i];
+
+        if (q->class == class && strlen(q->port) == len && !memcmp(q->port, name, len))
+            max = min(max, q->max);
+    }
+    return max;
+}
+
+/* Uncount a device of one class on its port and every port above it */
+static void quota_release(const char *name, u8 class)
+{
+    size_t len;
+
+    for (len = strlen(name); ; len = port_parent(name, len)) {
+        atomic_dec(&port_count_get(name, len)->devices[class]);
+        if (!len) break;
+    }
+}
+
+/*
+ * Count a device with an interface of class on its port, every port above
+ * it and globally, and check the quotas there. The counters are atomics
+ * that are bumped first and checked after, so concurrent probes cannot
+ * both slip under a limit; an over-quota probe is rolled back unless
+ * force (audit mode) keeps it. Ports are at most 7 tiers deep.
+ */
+static int quota_charge(const char *name, u8 class, bool force)
+{
+    const struct usbguard_policy *pol;
+    bool over = false;
+    size_t len;
+    int n;
+
+    /* create the counters first; they are never freed, so no lock is kept */
+    for (len = strlen(name); ; len = port_parent(name, len)) {
+        if (!port_count_get(name, len)) return -ENOMEM;
+        if (!len) break;
+    }
+
+    rcu_read_lock();
+    pol = rcu_dereference(policy);
+    for (len = strlen(name); ; len = port_parent(name, len)) {
+        n = atomic_inc_return(&port_count_get(name, len)->devices[class]);
+        if (pol->nr_quotas && n > quota_limit(pol, name, len, class))
+            over = true;
+        if (!len) break;
+    }
+    rcu_read_unlock();
+
+    if (!over) return 0;
+    if (!force) quota_release(name, class);
+    return -EDQUOT;
+}
+
+/* Account one probe; bucket b counts probes that took less than 2^b us */
+static void probe_account(u64 ns, bool rejected, bool audited, bool cached)
+{
+    struct probe_stats *st = get_cpu_ptr(&probe_stats);
+    u64 us = div_u64(ns, NSEC_PER_USEC);
+    unsigned int b = us ? min(ilog2(us) + 1, PROBE_HIST_BUCKETS - 1) : 0;
+
+    st->probes++;
+    st->rejected += rejected;
+    st->audited += audited;
+    st->cached += cached;
+    st->ns += ns;
+    st->max_ns = max(st->max_ns, ns);
+    st->hist[b]++;
+    put_cpu_ptr(&probe_stats);
+}
+
+static int usbguard_check(struct usb_interface *interface, bool *audited, bool *cached)
+{
+    struct usb_device *udev = interface_to_usbdev(interface);
+    u8 class = interface->cur_altsetting->desc.bInterfaceClass;
+    int mode = READ_ONCE(usbguard_mode);
+    struct usbguard_dev *dev;
+    const char *reason = NULL, *why;
+    int rc;
+
+    dev = usbguard_dev_get(udev);
+    if (mode == MODE_ALLOW) {
+        pr_info("usbguard: mode allow, device accepted\n");
+        if (dev) WRITE_ONCE(dev->verdict, VERDICT_ACCEPTED);
+        return 0;
+    }
+    if (mode == MODE_DENY) {
+        pr_alert("usbguard: mode deny, rejecting device\n");
+        if (dev) WRITE_ONCE(dev->verdict, VERDICT_REJECTED);
+        return -EACCES;
+    }
+    if (!dev) return -ENOMEM;
+
+    if (dev->seq == U64_MAX)
+        WRITE_ONCE(dev->fingerprint, device_fingerprint(udev));
+    *cached = dev->seq == policy_seq();
+    if (!*cached) {
+        why = evaluate_device(udev, dev->fingerprint, &dev->seq);
+        dev->allowed = !why;
+        if (why && !probe_quiet(udev))
+            pr_alert("usbguard: %s serial=%s: %s\n", dev_name(&udev->dev),
+                     udev->serial ? udev->serial : "-", why);
+    }
+
+    if (!probe_quiet(udev))
+        pr_info("usbguard: device VID=%04x PID=%04x fingerprint=%016llx attached\n",
+                dev->vid, dev->pid, dev->fingerprint);
+
+    if (!dev->allowed)
+        reason = "device not allowed by policy";
+    else if (!check_interface_classes(interface))
+        reason = "interface class not allowed";
+    else if (!test_bit(class, dev->classes)) {
+        rc = quota_charge(dev_name(&udev->dev), class, mode == MODE_AUDIT);
+        if (rc == -ENOMEM) return rc;
+        if (!rc || mode == MODE_AUDIT)
+            __set_bit(class, dev->classes);
+        if (rc) reason = "device quota for its class reached";
+    }
+
+    if (reason && mode == MODE_AUDIT) {
+        if (!probe_quiet(udev)) pr_alert("usbguard: audit: %s, would reject device\n", reason);
+        WRITE_ONCE(dev->verdict, VERDICT_AUDITED);
+        *audited = true;
+    } else if (reason) {
+        if (!probe_quiet(udev)) pr_alert("usbguard: %s, rejecting device\n", reason);
+        WRITE_ONCE(dev->verdict, VERDICT_REJECTED);
+        return -EACCES;
+    }
+
+    if (!probe_quiet(udev)) pr_info("usbguard: device accepted\n");
+    if (!*audited)
+        WRITE_ONCE(dev->verdict, VERDICT_ACCEPTED);
+    return 0;
+}
+
+/* Probe function */
+static int usbguard_probe(struct usb_interface *interface, const struct usb_device_id *id)
+{
+    u64 start = ktime_get_ns();
+    bool audited = false, cached = false;
+    int rc;
+
+    rc = usbguard_check(interface, &audited, &cached);
+    probe_account(ktime_get_ns() - start, rc, audited, cached);
+    return rc;
+}
+
+/* Disconnect function */
+static void usbguard_disconnect(struct usb_interface *interface)
+{
+    struct usb_device *udev = interface_to_usbdev(interface);
+
+    if (probe_quiet(udev)) return;
+    pr_info("usbguard: device VID=%04x PID=%04x serial=%s on %s disconnected\n",
+            le16_to_cpu(udev->descriptor.idVendor),
+            le16_to_cpu(udev->descriptor.idProduct),
+            udev->serial ? udev->serial : "-", dev_name(&udev->dev));
+}
+
+/*
+ * List a device once the USB core has configured it, whether or not any
+ * of its interfaces reach the probe, and drop its entry once it is gone.
+ * The add notification comes with the device lock held.
+ */
+static int usbguard_usb_notify(struct notifier_block *nb, unsigned long action, void *data)
+{
+    struct usb_device *udev = data;
+    struct usbguard_dev *dev;
+
+    if (action == USB_DEVICE_ADD) {
+        usbguard_dev_get(udev);
+        return NOTIFY_OK;
+    }
+    if (action != USB_DEVICE_REMOVE)
+        return NOTIFY_DONE;
+
+    dev = xa_erase(&devices, usbguard_dev_key(udev));
+    if (dev) {
+        unsigned int class;
+
+        for_each_set_bit(class, dev->classes, USB_CLASSES)
+            quota_release(dev_name(&udev->dev), class);
+        kfree_rcu(dev, rcu);
+    }
+    return NOTIFY_OK;
+}
+
+static struct notifier_block usbguard_nb = {
+    .notifier_call = usbguard_usb_notify,
+};
+
+/* Match all devices (demo purposes) */
+static const struct usb_device_id usbguard_table[] = {
+    { USB_DEVICE_INFO(0, 0, 0) },
+    {}
+};
+MODULE_DEVICE_TABLE(usb, usbguard_table);
+
+/* USB driver */
+static struct usb_driver usbguard_driver = {
+    .name = "usbguard_demo",
+    .probe = usbguard_probe,
+    .disconnect = usbguard_disconnect,
+    .id_table = usbguard_table,
+};
+
+/* Print merged ranges as "VID PID" or "VID LO-HI" lines, after "@port " or "%ns " */
+static ssize_t ruleset_show(const struct ruleset *set, char sigil, const char *scope,
+                            char *buf, ssize_t len)
+{
+    size_t i;
+
+    for (i = 0; i < set->count; i++) {
+        const struct vidpid_range *r = &set->ranges[i];
+
+        if (scope)
+            len += scnprintf(buf+len, PAGE_SIZE-len, "%c%s ", sigil, scope);
+        len += scnprintf(buf+len, PAGE_SIZE-len, "%04x %04x",
+                         r->lo >> 16, r->lo & 0xFFFF);
+        if (r->hi != r->lo)
+            len += scnprintf(buf+len, PAGE_SIZE-len, "-%04x", r->hi & 0xFFFF);
+        len += scnprintf(buf+len, PAGE_SIZE-len, "\n");
+    }
+    return len;
+}
+
+/* Print temporary rules with the seconds they have left */
+static ssize_t grants_show(const struct grant_list *gl, char *buf, ssize_t len)
+{
+    u64 now = get_jiffies_64();
+    u32 i;
+
+    for (i = 0; i < gl->count; i++) {
+        const struct usbguard_grant *g = &gl->items[i];
+        u64 left = time_after64(g->expires, now) ? g->expires - now : 0;
+
+        len += scnprintf(buf+len, PAGE_SIZE-len, "%04x %04x", g->rule.vid, g->rule.pid);
+        if (g->rule.mask != 0xFFFF)
+            len += scnprintf(buf+len, PAGE_SIZE-len, "/%04x", g->rule.mask);
+        else if (g->rule.pid_hi != g->rule.pid)
+            len += scnprintf(buf+len, PAGE_SIZE-len, "-%04x", g->rule.pid_hi);
+        len += scnprintf(buf+len, PAGE_SIZE-len, " ttl=%llu\n",
+                         div_u64(left + HZ - 1, HZ));
+    }
+    return len;
+}
+
+/*
+ * View of a reader inside a user namespace: the view of its namespace or
+ * of the nearest ancestor that has one
+ */
+static const struct usbguard_view *reader_view(const struct usbguard_policy *pol)
+{
+    const struct user_namespace *ns;
+    const struct usbguard_view *view;
+
+    for (ns = current_user_ns(); ns && ns != &init_user_ns; ns = ns->parent) {
+        view = view_lookup(pol, ns->ns.inum);
+        if (view) return view;
+    }
+    return NULL;
+}
+
+/*
+ * Sysfs: show rules. Readers inside a user namespace only see the rules
+ * of their view, and nothing when they have none.
+ */
+static ssize_t rules_show(struct kobject *k, struct kobj_attribute *attr, char *buf)
+{
+    const struct usbguard_policy *pol;
+    const struct usbguard_view *view;
+    const struct fp_set *fps;
+    struct usbguard_port *port;
+    char ns[11];
+    ssize_t len = 0;
+    int i, bkt;
+
+    rcu_read_lock();
+    pol = rcu_dereference(policy);
+    if (current_user_ns() != &init_user_ns) {
+        view = reader_view(pol);
+        if (view)
+            len = ruleset_show(&view->rules, 0, NULL, buf, len);
+        goto out;
+    }
+
+    fps = &pol->fingerprints;
+    len = ruleset_show(&pol->rules, 0, NULL, buf, len);
+    hash_for_each(pol->ports, bkt, port, node)
+        len = ruleset_show(&port->rules, '@', port->name, buf, len);
+    for (i = 0; fps->slots && i <= fps->mask; i++)
+        if (fps->slots[i])
+            len += scnprintf(buf+len, PAGE_SIZE-len, "fp %016llx\n", fps->slots[i]);
+    hash_for_each(pol->views, bkt, view, node) {
+        snprintf(ns, sizeof(ns), "%u", view->ns);
+        len = ruleset_show(&view->rules, '%', ns, buf, len);
+    }
+    hash_for_each(pol->ports, bkt, port, node)
+        if (port->ns)
+            len += scnprintf(buf+len, PAGE_SIZE-len, "%%%u @%s\n", port->ns, port->name);
+    len = grants_show(&pol->grants, buf, len);
+    for (i = 0; i < pol->nr_quotas; i++) {
+        const struct usbguard_quota *q = &pol->quotas[i];
+
+        len += scnprintf(buf+len, PAGE_SIZE-len, "quota %s%s%s%02x %u\n",
+                         q->port[0] ? "@" : "", q->port, q->port[0] ? " " : "",
+                         q->class, q->max);
+    }
+out:
+    rcu_read_unlock();
+    return len;
+}
+
+struct store_ctx {
+    const char *name;
+    struct usbguard_policy *pol;
+    int (*apply)(struct usbguard_policy *, char *);
+};
+
+/* Apply one line of a sysfs write, logging it if it is rejected */
+static int store_line(void *arg, char *line)
+{
+    struct store_ctx *sc = arg;
+    char orig[RULE_LINE_MAX], *p;
+    int rc;
+
+    /* apply() splits the line in place, keep a copy to log */
+    strscpy(orig, line, sizeof(orig));
+    rc = sc->apply(sc->pol, line);
+    p = trim(orig);
+    if (rc && rc != -ENOMEM && rc != -ENOSPC && *p && *p != '#')
+        pr_info("usbguard: %s: skipping line \"%s\" (%d)\n", sc->name, p, rc);
+    return rc;
+}
+
+/*
+ * Apply the lines of a sysfs write in one publish. Malformed lines are
+ * logged and skipped. Running out of memory or table space stops the
+ * write: the lines before it are published and the bytes they took are
+ * returned, or the error when no line got in.
+ */
+static ssize_t store_lines(struct kobject *k, const char *name, const char *buf, size_t count,
+                           int (*apply)(struct usbguard_policy *, char *))
+{
+    struct store_ctx sc = { name, NULL, apply };
+    size_t done = 0, accepted = 0;
+    char *tmp;
+    int rc = 0;
+
+    tmp = kmemdup_nul(buf, count, GFP_KERNEL);
+    if (!tmp) return -ENOMEM;
+
+    mutex_lock(&rules_lock);
+    if (stress_busy(k)) {
+        rc = -EBUSY;
+        goto out;
+    }
+    sc.pol = policy_begin();
+    if (!sc.pol) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    rc = apply_lines(tmp, count, store_line, &sc, &done, &accepted);
+    if (rc && !done) {
+        policy_free(sc.pol);
+        goto out;
+    }
+    policy_publish(sc.pol);
+    if (rc)
+        pr_alert("usbguard: %s: accepted %zu lines, stopped at byte %zu (%d)\n",
+                 name, accepted, done, rc);
+
+out:
+    mutex_unlock(&rules_lock);
+    kfree(tmp);
+    return done ? done : rc;
+}
+
+static int rules_line(struct usbguard_policy *pol, char *line)
+{
+    return apply_rule_line(pol, line, "sysfs");
+}
+
+/* Sysfs: add or remove rules */
+static ssize_t rules_store(struct kobject *k, struct kobj_attribute *attr,
+                           const char *buf, size_t count)
+{
+    return store_lines(k, "rules", buf, count, rules_line);
+}
+
+static struct kobj_attribute rules_attr = __ATTR(rules, 0664, rules_show, rules_store);
+
+/* Sysfs: show blocked serials */
+static ssize_t blocked_show(struct kobject *k, struct kobj_attribute *attr, char *buf)
+{
+    const struct usbguard_policy *pol;
+    const struct serial_ref *ref;
+    ssize_t len = 0;
+    rcu_read_lock();
+    pol = rcu_dereference(policy);
+    serial_set_for_each(&pol->serials, ref) {
+        len += scnprintf(buf+len, PAGE_SIZE-len, "%.*s\n", (int)ref->len, pol->serials.arena + ref->off);
+    }
+    rcu_read_unlock();
+    return len;
+}
+
+/* Sysfs: add or remove blocked serials */
+static ssize_t blocked_store(struct kobject *k, struct kobj_attribute *attr,
+                             const char *buf, size_t count)
+{
+    return store_lines(k, "blocked_serials", buf, count, apply_blocked_line);
+}
+
+static struct kobj_attribute blocked_attr = __ATTR(blocked_serials, 0664, blocked_show, blocked_store);
+
+/*
+ * Sysfs: apply a policy diff in a single publish. The first line is
+ * "generation N", followed by rule lines ("+" or "-" prefixed, as for
+ * the rules attribute) and "serial S" / "-serial S" lines. Pushing the
+ * current generation again is a no-op, an older one is rejected, and a
+ * bad line rejects the whole diff.
+ */
+static ssize_t policy_store(struct kobject *k, struct kobj_attribute *attr,
+                            const char *buf, size_t count)
+{
+    struct usbguard_policy *pol;
+    char *tmp, *line, *p, *op;
+    u64 gen, cur;
+    int rc = 0;
+
+    tmp = kstrdup(buf, GFP_KERNEL);
+    if (!tmp) return -ENOMEM;
+
+    line = tmp;
+    p = strsep(&line, "\n");
+    op = next_token(&p);
+    if (!op || strcmp(op, "generation") || !(op = next_token(&p)) ||
+        kstrtou64(op, 10, &gen) || next_token(&p)) {
+        kfree(tmp);
+        return -EINVAL;
+    }
+
+    mutex_lock(&rules_lock);
+    if (stress_busy(k)) {
+        rc = -EBUSY;
+        goto out;
+    }
+    cur = rcu_dereference_protected(policy, lockdep_is_held(&rules_lock))->generation;
+    if (gen <= cur) {
+        rc = gen == cur ? 0 : -ESTALE;
+        goto out;
+    }
+
+    pol = policy_begin();
+    if (!pol) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    while (line && !rc) {
+        p = trim(strsep(&line, "\n"));
+        if (*p != '\0' && *p != '#')
+            rc = apply_diff_line(pol, p);
+    }
+
+    if (rc) {
+        pr_alert("usbguard: policy diff for generation %llu rejected (%d)\n", gen, rc);
+        policy_free(pol);
+        goto out;
+    }
+    pol->generation = gen;
+    policy_publish(pol);
+    pr_info("usbguard: policy generation %llu published\n", gen);
+
+out:
+    mutex_unlock(&rules_lock);
+    kfree(tmp);
+    return rc ? rc : count;
+}
+
+static struct kobj_attribute policy_attr = __ATTR(policy, 0200, NULL, policy_store);
+
+/* Sysfs: show the generation of the last applied diff */
+static ssize_t generation_show(struct kobject *k, struct kobj_attribute *attr, char *buf)
+{
+    u64 gen;
+
+    rcu_read_lock();
+    gen = rcu_dereference(policy)->generation;
+    rcu_read_unlock();
+    return sysfs_emit(buf, "%llu\n", gen);
+}
+
+static struct kobj_attribute generation_attr = __ATTR_RO(generation);
+
+/*
+ * Sysfs: re-read the rules file and drop-ins into a fresh snapshot and swap it in.
+ * The old policy stays in force until the swap and is kept if the file
+ * cannot be read. Runtime additions and hit counts are dropped; grants
+ * that have not expired are kept. The generation moves one past the live
+ * one, so that an agent sees the policy changed under it.
+ */
+static ssize_t reload_store(struct kobject *k, struct kobj_attribute *attr,
+                            const char *buf, size_t count)
+{
+    const struct usbguard_policy *cur;
+    struct usbguard_policy *pol;
+    u64 gen;
+    int rc;
+
+    pol = policy_clone(NULL);
+    if (!pol) return -ENOMEM;
+
+    rc = load_policy(pol);
+    if (rc) {
+        policy_free(pol);
+        return rc;
+    }
+
+    mutex_lock(&rules_lock);
+    cur = rcu_dereference_protected(policy, lockdep_is_held(&rules_lock));
+    rc = stress_busy(k) ? -EBUSY : grant_list_copy(&pol->grants, &cur->grants);
+    if (rc) {
+        mutex_unlock(&rules_lock);
+        policy_free(pol);
+        return rc;
+    }
+    gen = pol->generation = cur->generation + 1;
+    policy_publish(pol);
+    mutex_unlock(&rules_lock);
+    pr_info("usbguard: reloaded rules from %s and %s, generation %llu\n",
+            rules_path, rules_dir, gen);
+    return count;
+}
+
+static struct kobj_attribute reload_attr = __ATTR_WO(reload);
+
+/*
+ * Sum the per-CPU probe counters. Counters of other CPUs are read without
+ * synchronization, so a line may be off by the probes running right now.
+ */
+static ssize_t probe_stats_show(char *buf, ssize_t len)
+{
+    struct probe_stats sum = {};
+    int cpu, b;
+
+    for_each_possible_cpu(cpu) {
+        const struct probe_stats *st = per_cpu_ptr(&probe_stats, cpu);
+
+        sum.probes += data_race(st->probes);
+        sum.rejected += data_race(st->rejected);
+        sum.audited += data_race(st->audited);
+        sum.cached += data_race(st->cached);
+        sum.ns += data_race(st->ns);
+        sum.max_ns = max(sum.max_ns, data_race(st->max_ns));
+        for (b = 0; b < PROBE_HIST_BUCKETS; b++)
+            sum.hist[b] += data_race(st->hist[b]);
+    }
+
+    len += sysfs_emit_at(buf, len, "probes %llu\n", sum.probes);
+    len += sysfs_emit_at(buf, len, "probes_rejected %llu\n", sum.rejected);
+    len += sysfs_emit_at(buf, len, "probes_audited %llu\n", sum.audited);
+    len += sysfs_emit_at(buf, len, "probes_cached %llu\n", sum.cached);
+    len += sysfs_emit_at(buf, len, "probe_ns_avg %llu\n",
+                         sum.probes ? div64_u64(sum.ns, sum.probes) : 0);
+    len += sysfs_emit_at(buf, len, "probe_ns_max %llu\n", sum.max_ns);
+    len += sysfs_emit_at(buf, len, "probe_us_hist");
+    for (b = 0; b < PROBE_HIST_BUCKETS; b++)
+        len += sysfs_emit_at(buf, len, " %llu", sum.hist[b]);
+    len += sysfs_emit_at(buf, len, "\n");
+    return len;
+}
+
+/* Sysfs: sizes and parameters of the live policy tables, then probe counters */
+static ssize_t stats_show(struct kobject *k, struct kobj_attribute *attr, char *buf)
+{
+    const struct usbguard_policy *pol;
+    const struct serial_set *set;
+    u32 bloom_bits, set_bits = 0;
+    ssize_t len;
+
+    rcu_read_lock();
+    pol = rcu_dereference(policy);
+    set = &pol->serials;
+    bloom_bits = set->bloom_blocks * BLOOM_BLOCK_BITS;
+    if (set->bloom)
+        set_bits = bitmap_weight(set->bloom, bloom_bits);
+
+    len = sysfs_emit(buf, "serials %u\n", set->count);
+    len += sysfs_emit_at(buf, len, "serial_bloom_bits %u\n", bloom_bits);
+    len += sysfs_emit_at(buf, len, "serial_bloom_block_bits %u\n", BLOOM_BLOCK_BITS);
+    len += sysfs_emit_at(buf, len, "serial_bloom_hashes %u\n", BLOOM_HASHES);
+    len += sysfs_emit_at(buf, len, "serial_bloom_set_bits %u\n", set_bits);
+    rcu_read_unlock();
+
+    return probe_stats_show(buf, len);
+}
+
+/* Sysfs: any write clears the probe counters, e.g. between two load runs */
+static ssize_t stats_store(struct kobject *k, struct kobj_attribute *attr,
+                           const char *buf, size_t count)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        data_race(memset(per_cpu_ptr(&probe_stats, cpu), 0, sizeof(struct probe_stats)));
+    return count;
+}
+
+static struct kobj_attribute stats_attr = __ATTR(stats, 0644, stats_show, stats_store);
+
+/* Sysfs: operating mode, same as the mode module parameter */
+static ssize_t mode_show(struct kobject *k, struct kobj_attribute *attr, char *buf)
+{
+    return mode_param_get(buf, NULL);
+}
+
+static ssize_t mode_store(struct kobject *k, struct kobj_attribute *attr,
+                          const char *buf, size_t count)
+{
+    int rc = mode_set(buf);
+
+    return rc ? rc : count;
+}
+
+static struct kobj_attribute mode_attr = __ATTR(mode, 0644, mode_show, mode_store);
+
+static size_t ruleset_bytes(const struct ruleset *set)
+{
+    return set->cap * (sizeof(*set->ranges) + sizeof(*set->hits));
+}
+
+static size_t serial_set_bytes(const struct serial_set *set)
+{
+    size_t len = set->arena_cap + set->refs_cap * sizeof(*set->refs);
+
+    if (set->index)
+        len += (set->mask + 1) * sizeof(*set->index);
+    return len + set->bloom_blocks * BLOOM_BLOCK_BITS / 8;
+}
+
+/* Sysfs: bytes allocated for the live policy tables and the device cache */
+static ssize_t memory_show(struct kobject *k, struct kobj_attribute *attr, char *buf)
+{
+    const struct usbguard_policy *pol;
+    struct usbguard_port *port;
+    struct usbguard_view *view;
+    struct usbguard_dev *dev;
+    size_t rules, grants, ports = 0, views = 0, fps = 0, serials, devs = 0;
+    unsigned long key;
+    ssize_t len;
+    int bkt;
+
+    rcu_read_lock();
+    pol = rcu_dereference(policy);
+    rules = ruleset_bytes(&pol->rules);
+    grants = pol->grants.cap * sizeof(*pol->grants.items) + ruleset_bytes(&pol->grants.set);
+    hash_for_each(pol->ports, bkt, port, node)
+        ports += sizeof(*port) + ruleset_bytes(&port->rules);
+    hash_for_each(pol->views, bkt, view, node)
+        views += sizeof(*view) + ruleset_bytes(&view->rules);
+    if (pol->fingerprints.slots)
+        fps = (pol->fingerprints.mask + 1) *
+              (sizeof(*pol->fingerprints.slots) + sizeof(*pol->fingerprints.hits));
+    serials = serial_set_bytes(&pol->serials);
+    xa_for_each(&devices, key, dev)
+        devs += struct_size(dev, serial, strlen(dev->serial) + 1);
+    rcu_read_unlock();
+
+    len = sysfs_emit(buf, "policy %zu\n", sizeof(*pol));
+    len += sysfs_emit_at(buf, len, "rules %zu\n", rules);
+    len += sysfs_emit_at(buf, len, "grants %zu\n", grants);
+    len += sysfs_emit_at(buf, len, "ports %zu\n", ports);
+    len += sysfs_emit_at(buf, len, "views %zu\n", views);
+    len += sysfs_emit_at(buf, len, "fingerprints %zu\n", fps);
+    len += sysfs_emit_at(buf, len, "serials %zu\n", serials);
+    len += sysfs_emit_at(buf, len, "devices %zu\n", devs);
+    len += sysfs_emit_at(buf, len, "total %zu\n",
+                         sizeof(*pol) + rules + grants + ports + views + fps + serials + devs);
+    return len;
+}
+
+static struct kobj_attribute memory_attr = __ATTR_RO(memory);
+
+/*
+ * Sysfs: binary snapshot of the live policy. A read from offset 0 rebuilds
+ * the image if the policy changed, later offsets continue the same image.
+ * Feed it back through rules_path or rules_firmware to restore the policy.
+ */
+static ssize_t snapshot_read(struct file *filp, struct kobject *k, struct bin_attribute *attr,
+                             char *buf, loff_t off, size_t count)
+{
+    const struct usbguard_policy *pol;
+    ssize_t rc = 0;
+
+    mutex_lock(&rules_lock);
+    pol = rcu_dereference_protected(policy, lockdep_is_held(&rules_lock));
+    if (off == 0 && (!snapshot_img.data || snapshot_img.seq != pol->seq)) {
+        size_t len;
+        void *data = policy_export(pol, &len);
+
+        if (!data) {
+            rc = -ENOMEM;
+            goto out;
+        }
+        kvfree(snapshot_img.data);
+        snapshot_img.data = data;
+        snapshot_img.len = len;
+        snapshot_img.seq = pol->seq;
+    }
+    if (off < snapshot_img.len) {
+        rc = min_t(size_t, count, snapshot_img.len - off);
+        memcpy(buf, snapshot_img.data + off, rc);
+    }
+out:
+    mutex_unlock(&rules_lock);
+    return rc;
+}
+
+static BIN_ATTR_RO(snapshot, 0);
+
+#ifdef USBGUARD_BENCH
+#define BENCH_MAX_ENTRIES (1 << 20)
+#define BENCH_LOOKUPS (1 << 20)     /* per CPU and run */
+#define BENCH_KEYS 4096             /* lookup keys cycled through, half of them hits */
+#define BENCH_SERIAL_LEN 12
+
+struct bench_ctx;
+
+struct bench_work {
+    struct work_struct work;
+    const struct bench_ctx *ctx;
+    u64 ns;
+    unsigned long found;
+};
+
+struct bench_writer {
+    struct work_struct work;
+    struct bench_ctx *ctx;
+    u64 publishes;
+    int err;                        /* the writer could not copy the policy */
+};
+
+/*
+ * Synthetic policy and the keys looked up in it. Readers go through
+ * rcu_dereference(live) like the probe path; live is pol except while a
+ * bench writer is republishing copies of it.
+ */
+struct bench_ctx {
+    struct usbguard_policy *pol;
+    struct usbguard_policy __rcu *live;
+    u32 keys[BENCH_KEYS];
+    char serials[BENCH_KEYS][BENCH_SERIAL_LEN];
+    bool serial;                    /* time serial_blocked() instead of rule matching */
+    bool stop;                      /* set once the readers are done */
+    struct bench_writer writer;     /* queued work, so not on the caller's stack */
+};
+
+static DEFINE_MUTEX(bench_lock);
+static char bench_result[PAGE_SIZE];
+
+static void bench_run(struct bench_work *bw)
+{
+    const struct bench_ctx *ctx = bw->ctx;
+    const struct usbguard_policy *pol;
+    unsigned long found = 0;
+    ktime_t start = ktime_get();
+    u32 i;
+
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        u32 k = i & (BENCH_KEYS - 1);
+
+        rcu_read_lock();
+        pol = rcu_dereference(ctx->live);
+        if (ctx->serial)
+            found += serial_blocked(pol, ctx->serials[k]);
+        else
+            found += ruleset_match(&pol->rules, ctx->keys[k]);
+        rcu_read_unlock();
+        /* Let a bench writer's grace period end on non-preemptible kernels */
+        if (k == BENCH_KEYS - 1)
+            cond_resched();
+    }
+    bw->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    bw->found = found;
+}
+
+static void bench_work_fn(struct work_struct *work)
+{
+    bench_run(container_of(work, struct bench_work, work));
+}
+
+/*
+ * Clone and republish the bench policy until the readers are done, the
+ * way policy writers do: every publish copies all tables and waits for a
+ * grace period before freeing the previous copy.
+ */
+static void bench_writer_fn(struct work_struct *work)
+{
+    struct bench_writer *w = container_of(work, struct bench_writer, work);
+    struct bench_ctx *ctx = w->ctx;
+    struct usbguard_policy *old, *pol;
+
+    while (!READ_ONCE(ctx->stop)) {
+        old = rcu_dereference_protected(ctx->live, 1);
+        pol = policy_clone(old);
+        if (!pol) {
+            w->err = -ENOMEM;
+            break;
+        }
+        rcu_assign_pointer(ctx->live, pol);
+        synchronize_rcu();
+        if (old != ctx->pol)
+            policy_free(old);
+        w->publishes++;
+        cond_resched();
+    }
+}
+
+/*
+ * Run the lookups once on every online CPU at the same time. With a
+ * writer, the first online CPU runs the writer instead of lookups.
+ */
+static int bench_all_cpus(struct bench_ctx *ctx, struct bench_writer *w,
+                          u64 *ns, unsigned int *cpus)
+{
+    struct usbguard_policy *live;
+    struct bench_work *bw;
+    int cpu, wcpu = -1;
+
+    bw = kcalloc(nr_cpu_ids, sizeof(*bw), GFP_KERNEL);
+    if (!bw) return -ENOMEM;
+
+    *ns = 0;
+    *cpus = 0;
+    cpus_read_lock();
+    if (w) {
+        wcpu = cpumask_first(cpu_online_mask);
+        INIT_WORK(&w->work, bench_writer_fn);
+        w->ctx = ctx;
+        w->publishes = 0;
+        w->err = 0;
+        WRITE_ONCE(ctx->stop, false);
+        queue_work_on(wcpu, system_highpri_wq, &w->work);
+    }
+    for_each_online_cpu(cpu) {
+        if (cpu == wcpu) continue;
+        INIT_WORK(&bw[cpu].work, bench_work_fn);
+        bw[cpu].ctx = ctx;
+        queue_work_on(cpu, system_highpri_wq, &bw[cpu].work);
+    }
+    for_each_online_cpu(cpu) {
+        if (cpu == wcpu) continue;
+        flush_work(&bw[cpu].work);
+        *ns += bw[cpu].ns;
+        (*cpus)++;
+    }
+    if (w) {
+        WRITE_ONCE(ctx->stop, true);
+        flush_work(&w->work);
+        live = rcu_dereference_protected(ctx->live, 1);
+        rcu_assign_pointer(ctx->live, ctx->pol);
+        if (live != ctx->pol) {
+            synchronize_rcu();
+            policy_free(live);
+        }
+    }
+    cpus_read_unlock();
+    kfree(bw);
+    return w ? w->err : 0;
+}
+
+static size_t bench_report(size_t len, const char *name, u32 entries, unsigned int cpus, u64 ns)
+{
+    u64 lookups = (u64)BENCH_LOOKUPS * cpus;
+    u64 ps = div64_u64(ns * 1000, lookups);
+    u32 frac;
+    u64 whole = div_u64_rem(ps, 1000, &frac);
+
+    return len + scnprintf(bench_result + len, sizeof(bench_result) - len,
+                           "bench=%s entries=%u cpus=%u lookups=%llu ns_per_lookup=%llu.%03u\n",
+                           name, entries, cpus, lookups, whole, frac);
+}
+
+/* Same as bench_report(), for a run next to a writer */
+static size_t bench_report_writer(size_t len, const char *name, u32 entries, unsigned int cpus,
+                                  u64 ns, u64 publishes)
+{
+    /* Replace the newline with the writer's publish count */
+    len = bench_report(len, name, entries, cpus, ns) - 1;
+    return len + scnprintf(bench_result + len, sizeof(bench_result) - len,
+                           " publishes=%llu\n", publishes);
+}
+
+/*
+ * Fill a private policy with n single-PID ranges, spaced so they never
+ * merge, and n serials. The range table is built directly so it is not
+ * bound by MAX_RULES.
+ */
+static int bench_fill(struct bench_ctx *ctx, u32 n)
+{
+    struct ruleset *set = &ctx->pol->rules;
+    char serial[BENCH_SERIAL_LEN];
+    u32 i;
+    int rc;
+
+    set->ranges = kvmalloc_array(n, sizeof(*set->ranges), GFP_KERNEL);
+    set->hits = kvcalloc(n, sizeof(*set->hits), GFP_KERNEL);
+    if (!set->ranges || !set->hits) return -ENOMEM;
+    for (i = 0; i < n; i++) {
+        u32 key = (0x1000 + (i >> 15)) << 16 | (i & 0x7FFF) * 2;
+
+        set->ranges[i].lo = set->ranges[i].hi = key;
+    }
+    set->count = set->cap = n;
+
+    for (i = 0; i < n; i++) {
+        snprintf(serial, sizeof(serial), "SN%08x", i);
+        rc = serial_set_add(&ctx->pol->serials, serial, strlen(serial));
+        if (rc) return rc;
+    }
+
+    for (i = 0; i < BENCH_KEYS; i++) {
+        u32 e = get_random_u32() % n;
+        bool hit = i & 1;
+
+        ctx->keys[i] = (0x1000 + (e >> 15)) << 16 | ((e & 0x7FFF) * 2 + !hit);
+        snprintf(ctx->serials[i], BENCH_SERIAL_LEN, "%cN%08x", hit ? 'S' : 'X', e);
+    }
+    return 0;
+}
+
+static void bench_free(struct bench_ctx *ctx)
+{
+    policy_free(ctx->pol);
+    kvfree(ctx);
+}
+
+/* Sysfs: write an entry count to benchmark lookups in tables of that size */
+static ssize_t bench_store(struct kobject *k, struct kobj_attribute *attr,
+                           const char *buf, size_t count)
+{
+    static const char * const names[] = { "match_rules", "serial_blocked" };
+    struct bench_ctx *ctx;
+    struct bench_work bw;
+    unsigned int cpus;
+    size_t len = 0;
+    u32 entries;
+    u64 ns;
+    int rc, i;
+
+    rc = kstrtou32(buf, 0, &entries);
+    if (rc) return rc;
+    if (entries == 0 || entries > BENCH_MAX_ENTRIES) return -ERANGE;
+
+    ctx = kvzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx) return -ENOMEM;
+    ctx->pol = policy_clone(NULL);
+    if (!ctx->pol) {
+        kvfree(ctx);
+        return -ENOMEM;
+    }
+    RCU_INIT_POINTER(ctx->live, ctx->pol);
+    rc = bench_fill(ctx, entries);
+    if (rc) goto out;
+
+    mutex_lock(&bench_lock);
+    for (i = 0; i < ARRAY_SIZE(names); i++) {
+        ctx->serial = i;
+        bw.ctx = ctx;
+        bench_run(&bw);
+        len = bench_report(len, names[i], entries, 1, bw.ns);
+        rc = bench_all_cpus(ctx, NULL, &ns, &cpus);
+        if (rc) break;
+        len = bench_report(len, names[i], entries, cpus, ns);
+        if (num_online_cpus() < 2) continue;
+        rc = bench_all_cpus(ctx, &ctx->writer, &ns, &cpus);
+        if (rc) break;
+        len = bench_report_writer(len, names[i], entries, cpus, ns, ctx->writer.publishes);
+    }
+    mutex_unlock(&bench_lock);
+
+out:
+    bench_free(ctx);
+    return rc ? rc : count;
+}
+
+/* Sysfs: results of the last benchmark or stress run, one key=value line per run */
+static ssize_t bench_show(struct kobject *k, struct kobj_attribute *attr, char *buf)
+{
+    ssize_t len;
+
+    mutex_lock(&bench_lock);
+    len = sysfs_emit(buf, "%s", bench_result);
+    mutex_unlock(&bench_lock);
+    return len;
+}
+
+static struct kobj_attribute bench_attr = __ATTR(bench, 0600, bench_show, bench_store);
+
+#define STRESS_MAX_SECONDS 3600
+#define STRESS_MAX_THREADS 64
+#define STRESS_PORTS 8              /* synthetic devices per reader */
+#define STRESS_VID 0x5000           /* writers and readers share VIDs 5000-5003 */
+#define STRESS_CLASS 0x70           /* classes 70-72, not assigned to any real device */
+
+/* Counters shared by the stress kthreads */
+struct stress_ctx {
+    atomic64_t plugs;
+    atomic64_t probes;
+    atomic64_t rejected;
+    atomic64_t writes;
+    atomic64_t write_errors;
+};
+
+/* Synthetic device with two interfaces, as a USB hub would hand it over */
+struct stress_dev {
+    struct usb_device *udev;
+    struct usb_interface intf[2];
+    struct usb_host_interface alt[2];
+    bool bound[2];
+};
+
+struct stress_reader {
+    struct stress_ctx *ctx;
+    struct task_struct *task;
+    struct usb_bus bus;
+    struct stress_dev devs[STRESS_PORTS];
+};
+
+static void stress_udev_release(struct device *dev)
+{
+    struct usb_device *udev = to_usb_device(dev);
+
+    kfree(udev->serial);
+    kfree(udev);
+}
+
+/*
+ * A struct usb_device that is never registered: enough of one for the
+ * probe path, the device table and the quota counters. Policy
+ * re-evaluation leaves it alone, so it is never configured or deconfigured.
+ */
+static struct usb_device *stress_udev_new(struct usb_bus *bus, int port, u32 rnd)
+{
+    struct usb_device *udev = kzalloc(sizeof(*udev), GFP_KERNEL);
+
+    if (!udev) return NULL;
+    device_initialize(&udev->dev);
+    udev->dev.release = stress_udev_release;
+    udev->bus = bus;
+    udev->devnum = port;
+    udev->state = USB_STATE_CONFIGURED;
+    udev->descriptor.bLength = USB_DT_DEVICE_SIZE;
+    udev->descriptor.idVendor = cpu_to_le16(STRESS_VID + rnd % 4);
+    udev->descriptor.idProduct = cpu_to_le16(rnd >> 2 & 0xF);
+    udev->serial = kasprintf(GFP_KERNEL, "STRESS%02x", rnd >> 6 & 0xF);
+    if (!udev->serial || dev_set_name(&udev->dev, "%d-%d", bus->busnum, port)) {
+        put_device(&udev->dev);
+        return NULL;
+    }
+    return udev;
+}
+
+/* Probe both interfaces of a device under its device lock, as the USB core does */
+static void stress_probe(struct stress_ctx *ctx, struct stress_dev *d)
+{
+    int i, rc;
+
+    usb_lock_device(d->udev);
+    for (i = 0; i < ARRAY_SIZE(d->intf); i++) {
+        if (d->bound[i]) continue;
+        rc = usbguard_probe(&d->intf[i], NULL);
+        d->bound[i] = !rc;
+        atomic64_inc(&ctx->probes);
+        if (rc) atomic64_inc(&ctx->rejected);
+    }
+    usb_unlock_device(d->udev);
+}
+
+static void stress_plug(struct stress_ctx *ctx, struct stress_reader *r, int port, u32 rnd)
+{
+    struct stress_dev *d = &r->devs[port];
+    int i;
+
+    d->udev = stress_udev_new(&r->bus, port + 1, rnd);
+    if (!d->udev) return;
+    for (i = 0; i < ARRAY_SIZE(d->intf); i++) {
+        d->alt[i].desc.bInterfaceClass = STRESS_CLASS + (rnd >> (10 + 2 * i)) % 3;
+        d->intf[i].cur_altsetting = &d->alt[i];
+        d->intf[i].dev.parent = &d->udev->dev;
+        d->bound[i] = false;
+    }
+    atomic64_inc(&ctx->plugs);
+    stress_probe(ctx, d);
+}
+
+/* Unbind, then send the removal notification the USB core would send */
+static void stress_unplug(struct stress_dev *d)
+{
+    int i;
+
+    usb_lock_device(d->udev);
+    for (i = 0; i < ARRAY_SIZE(d->intf); i++)
+        if (d->bound[i]) usbguard_disconnect(&d->intf[i]);
+    usb_unlock_device(d->udev);
+    usbguard_usb_notify(&usbguard_nb, USB_DEVICE_REMOVE, d->udev);
+    put_device(&d->udev->dev);
+    d->udev = NULL;
+}
+
+/* Plug, re-probe and unplug synthetic devices on random ports */
+static int stress_reader_fn(void *data)
+{
+    struct stress_reader *r = data;
+    int i;
+
+    while (!kthread_should_stop()) {
+        u32 rnd = get_random_u32();
+        int port = rnd % STRESS_PORTS;
+        struct stress_dev *d = &r->devs[port];
+
+        if (!d->udev)
+            stress_plug(r->ctx, r, port, rnd >> 3);
+        else if (rnd & BIT(31))
+            stress_unplug(d);
+        else
+            stress_probe(r->ctx, d);
+        cond_resched();
+    }
+    for (i = 0; i < STRESS_PORTS; i++)
+        if (r->devs[i].udev) stress_unplug(&r->devs[i]);
+    return 0;
+}
+
+/* Write one random line through the rules, blocked_serials or policy attribute */
+static int stress_writer_fn(void *data)
+{
+    struct stress_ctx *ctx = data;
+    char buf[128];
+    ssize_t rc;
+    u64 gen;
+    int n;
+
+    while (!kthread_should_stop()) {
+        u32 rnd = get_random_u32();
+        u16 vid = STRESS_VID + rnd % 4;
+        const char *op = rnd & BIT(31) ? "-" : "";
+
+        switch (rnd >> 2 & 7) {
+        case 0:
+        case 1:
+            snprintf(buf, sizeof(buf), "%s%04x %04x\n", op, vid, rnd >> 5 & 0xF);
+            rc = rules_store(NULL, NULL, buf, strlen(buf));
+            break;
+        case 2:
+            snprintf(buf, sizeof(buf), "%s%04x 0000/fff%x\n", op, vid, rnd >> 5 & 0xE);
+            rc = rules_store(NULL, NULL, buf, strlen(buf));
+            break;
+        case 3:
+            snprintf(buf, sizeof(buf), "%s@%d-%d %04x 0000-000f\n", op,
+                     STRESS_BUS + (rnd >> 5 & 3), (rnd >> 7) % STRESS_PORTS + 1, vid);
+            rc = rules_store(NULL, NULL, buf, strlen(buf));
+            break;
+        case 4:
+            snprintf(buf, sizeof(buf), "%04x %04x ttl=1s\n", vid, rnd >> 5 & 0xF);
+            rc = rules_store(NULL, NULL, buf, strlen(buf));
+            break;
+        case 5:
+            /* below a synthetic port and on a class no real device has */
+            n = snprintf(buf, sizeof(buf), "%squota @%d-%d %02x", op,
+                         STRESS_BUS + (rnd >> 5 & 3), (rnd >> 7) % STRESS_PORTS + 1,
+                         STRESS_CLASS + (rnd >> 10) % 3);
+            snprintf(buf + n, sizeof(buf) - n, *op ? "\n" : " %u\n", (rnd >> 12) % 4 + 1);
+            rc = rules_store(NULL, NULL, buf, strlen(buf));
+            break;
+        case 6:
+            snprintf(buf, sizeof(buf), "%sSTRESS%02x\n", op, rnd >> 5 & 0xF);
+            rc = blocked_store(NULL, NULL, buf, strlen(buf));
+            break;
+        default:
+            rcu_read_lock();
+            gen = rcu_dereference(policy)->generation;
+            rcu_read_unlock();
+            /* adds only: a bad line would reject the whole diff */
+            snprintf(buf, sizeof(buf), "generation %llu\n+%04x %04x\nserial STRESS%02x\n",
+                     gen + 1, vid, rnd >> 5 & 0xF, rnd >> 9 & 0xF);
+            rc = policy_store(NULL, NULL, buf, strlen(buf));
+            /* another writer got its generation in first */
+            if (rc == -ESTALE) rc = 0;
+            break;
+        }
+        atomic64_inc(&ctx->writes);
+        if (rc < 0) atomic64_inc(&ctx->write_errors);
+        cond_resched();
+    }
+    return 0;
+}
+
+/*
+ * Run readers and writers for the given number of seconds. The policy in
+ * place before the run is put back afterwards; sysfs writes are refused
+ * with EBUSY meanwhile rather than silently undone by that.
+ */
+static int stress_run(unsigned int seconds, unsigned int readers, unsigned int writers)
+{
+    struct usbguard_policy *saved = NULL;
+    struct task_struct **wtask;
+    struct stress_reader *r;
+    struct stress_ctx ctx = {};
+    u64 seq = policy_seq();
+    unsigned int i, nr = 0, nw = 0;
+    int rc = 0;
+
+    r = kcalloc(readers, sizeof(*r), GFP_KERNEL);
+    wtask = kcalloc(writers, sizeof(*wtask), GFP_KERNEL);
+    if (!r || !wtask) {
+        rc = -ENOMEM;
+        goto out;
+    }
+    /* from here until saved is put back, sysfs writes get EBUSY */
+    mutex_lock(&rules_lock);
+    saved = policy_begin();
+    stress_running = saved != NULL;
+    mutex_unlock(&rules_lock);
+    if (!saved) {
+        rc = -ENOMEM;
+        goto out;
+    }
+
+    for (nr = 0; nr < readers; nr++) {
+        r[nr].ctx = &ctx;
+        r[nr].bus.busnum = STRESS_BUS + nr;
+        r[nr].task = kthread_run(stress_reader_fn, &r[nr], "usbguard-sr%u", nr);
+        if (IS_ERR(r[nr].task)) {
+            rc = PTR_ERR(r[nr].task);
+            goto stop;
+        }
+    }
+    for (nw = 0; nw < writers; nw++) {
+        wtask[nw] = kthread_run(stress_writer_fn, &ctx, "usbguard-sw%u", nw);
+        if (IS_ERR(wtask[nw])) {
+            rc = PTR_ERR(wtask[nw]);
+            goto stop;
+        }
+    }
+    /* a signal ends the run early */
+    msleep_interruptible(seconds * MSEC_PER_SEC);
+
+stop:
+    for (i = 0; i < nw; i++)
+        kthread_stop(wtask[i]);
+    for (i = 0; i < nr; i++)
+        kthread_stop(r[i].task);
+
+    /* generations pushed during the run stay used up */
+    mutex_lock(&rules_lock);
+    saved->generation = rcu_dereference_protected(policy, lockdep_is_held(&rules_lock))->generation;
+    policy_publish(saved);
+    saved = NULL;
+    stress_running = false;
+    mutex_unlock(&rules_lock);
+
+    if (!rc)
+        scnprintf(bench_result, sizeof(bench_result),
+                  "stress seconds=%u readers=%u writers=%u plugs=%lld probes=%lld rejected=%lld "
+                  "writes=%lld write_errors=%lld publishes=%llu\n",
+                  seconds, readers, writers, atomic64_read(&ctx.plugs),
+                  atomic64_read(&ctx.probes), atomic64_read(&ctx.rejected),
+                  atomic64_read(&ctx.writes), atomic64_read(&ctx.write_errors),
+                  policy_seq() - seq);
+out:
+    policy_free(saved);
+    kfree(wtask);
+    kfree(r);
+    return rc;
+}
+
+/* Sysfs: write "SECONDS [READERS [WRITERS]]" to run the stress test */
+static ssize_t stress_store(struct kobject *k, struct kobj_attribute *attr,
+                            const char *buf, size_t count)
+{
+    unsigned int seconds, readers = num_online_cpus(), writers = 2;
+    int n, rc;
+
+    n = sscanf(buf, "%u %u %u", &seconds, &readers, &writers);
+    if (n < 1) return -EINVAL;
+    if (!seconds || seconds > STRESS_MAX_SECONDS || !readers ||
+        readers > STRESS_MAX_THREADS || writers > STRESS_MAX_THREADS)
+        return -ERANGE;
+
+    mutex_lock(&bench_lock);
+    rc = stress_run(seconds, readers, writers);
+    mutex_unlock(&bench_lock);
+    return rc ? rc : count;
+}
+
+static struct kobj_attribute stress_attr = __ATTR(stress, 0600, bench_show, stress_store);
+#endif
+
+static struct attribute *usbguard_attrs[] = {
+    &rules_attr.attr,
+    &blocked_attr.attr,
+    &policy_attr.attr,
+    &generation_attr.attr,
+    &reload_attr.attr,
+    &stats_attr.attr,
+    &memory_attr.attr,
+    &mode_attr.attr,
+#ifdef USBGUARD_BENCH
+    &bench_attr.attr,
+    &stress_attr.attr,
+#endif
+    NULL,
+};
+
+static struct bin_attribute *usbguard_bin_attrs[] = {
+    &bin_attr_snapshot,
+    NULL,
+};
+
+static const struct attribute_group usbguard_group = {
+    .attrs = usbguard_attrs,
+    .bin_attrs = usbguard_bin_attrs,
+};
+
+static void ruleset_dump(struct seq_file *m, const struct ruleset *set, char sigil,
+                         const char *scope)
+{
+    size_t i;
+
+    for (i = 0; i < set->count; i++) {
+        const struct vidpid_range *r = &set->ranges[i];
+
+        if (scope)
+            seq_printf(m, "%c%s ", sigil, scope);
+        seq_printf(m, "%04x %04x", r->lo >> 16, r->lo & 0xFFFF);
+        if (r->hi != r->lo)
+            seq_printf(m, "-%04x", r->hi & 0xFFFF);
+        seq_printf(m, " %ld\n", atomic_long_read(&set->hits[i]));
+    }
+}
+
+/*
+ * Debugfs: every rule and blocked serial of the live policy followed by
+ * its hit count, one per line in rules file syntax. Counts survive policy
+ * updates; merged ranges add up their counts and a reload resets them.
+ */
+static int hits_show(struct seq_file *m, void *v)
+{
+    const struct usbguard_policy *pol;
+    const struct serial_set *ss;
+    const struct serial_ref *ref;
+    struct usbguard_port *port;
+    struct usbguard_view *view;
+    char ns[11];
+    u32 i;
+    int bkt;
+
+    rcu_read_lock();
+    pol = rcu_dereference(policy);
+    ruleset_dump(m, &pol->rules, 0, NULL);
+    hash_for_each(pol->ports, bkt, port, node)
+        ruleset_dump(m, &port->rules, '@', port->name);
+    hash_for_each(pol->views, bkt, view, node) {
+        snprintf(ns, sizeof(ns), "%u", view->ns);
+        ruleset_dump(m, &view->rules, '%', ns);
+    }
+    for (i = 0; pol->fingerprints.slots && i <= pol->fingerprints.mask; i++)
+        if (pol->fingerprints.slots[i])
+            seq_printf(m, "fp %016llx %ld\n", pol->fingerprints.slots[i],
+                       atomic_long_read(&pol->fingerprints.hits[i]));
+    ss = &pol->serials;
+    serial_set_for_each(ss, ref)
+        seq_printf(m, "serial %.*s %ld\n", (int)ref->len, ss->arena + ref->off,
+                   atomic_long_read(&ref->hits));
+    rcu_read_unlock();
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hits);
+
+/*
+ * Debugfs: one line per attached device with its port, VID, PID, serial
+ * ("-" if none), latest probe verdict, attach time in seconds since the
+ * epoch and fingerprint.
+ */
+static int devices_show(struct seq_file *m, void *v)
+{
+    struct usbguard_dev *dev;
+    unsigned long key;
+
+    rcu_read_lock();
+    xa_for_each(&devices, key, dev)
+        seq_printf(m, "%s %04x %04x %s %s %lld %016llx\n", dev->port, dev->vid, dev->pid,
+                   dev->serial[0] ? dev->serial : "-",
+                   verdict_names[READ_ONCE(dev->verdict)],
+                   (long long)dev->attached, dev->fingerprint);
+    rcu_read_unlock();
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(devices);
+
+/* Module init */
+static int __init usbguard_init(void)
+{
+    struct usbguard_policy *pol;
+    int rc;
+
+    pol = policy_clone(NULL);
+    if (!pol) return -ENOMEM;
+    if ((!rules_firmware || !*rules_firmware) && load_policy(pol)) {
+        /* start empty rather than from half the rules */
+        pr_err("usbguard: rules not loaded, denying all devices\n");
+        policy_free(pol);
+        pol = policy_clone(NULL);
+        if (!pol) return -ENOMEM;
+    }
+    RCU_INIT_POINTER(policy, pol);
+    /* ttl= lines in the rules files arm the sweeper like a sysfs write */
+    grant_sweep_schedule(&pol->grants);
+
+    usbguard_kobj = kobject_create_and_add("usbguard", kernel_kobj);
+    if (!usbguard_kobj) {
+        rc = -ENOMEM;
+        goto out_policy;
+    }
+
+    rc = sysfs_create_group(usbguard_kobj, &usbguard_group);
+    if (rc) goto out_kobj;
+
+    usbguard_debugfs = debugfs_create_dir("usbguard", NULL);
+    debugfs_create_file("hits", 0400, usbguard_debugfs, NULL, &hits_fops);
+    debugfs_create_file("devices", 0400, usbguard_debugfs, NULL, &devices_fops);
+
+    usb_register_notify(&usbguard_nb);
+
+    rc = usb_register(&usbguard_driver);
+    if (rc) {
+        pr_alert("usbguard: usb_register failed %d\n", rc);
+        usb_unregister_notify(&usbguard_nb);
+        debugfs_remove_recursive(usbguard_debugfs);
+        sysfs_remove_group(usbguard_kobj, &usbguard_group);
+        goto out_kobj;
+    }
+
+    if (rules_firmware && *rules_firmware && request_policy_firmware()) {
+        pr_info("usbguard: could not request firmware %s, reading %s\n",
+                rules_firmware, rules_path);
+        mutex_lock(&rules_lock);
+        pol = policy_begin();
+        rc = pol ? load_policy(pol) : -ENOMEM;
+        if (rc) {
+            pr_err("usbguard: rules not loaded (%d), denying all devices\n", rc);
+            policy_free(pol);
+        } else {
+            policy_publish(pol);
+        }
+        mutex_unlock(&rules_lock);
+    }
+
+    pr_info("usbguard: demo module loaded\n");
+    return 0;
+
+    out_kobj:
+    kobject_put(usbguard_kobj);
+    out_policy:
+    cancel_delayed_work_sync(&grant_work);
+    cancel_work_sync(&reeval_work);
+    rcu_barrier();
+    policy_free(rcu_dereference_protected(policy, 1));
+    return rc;
+}
+
+/* Module exit */
+static void __exit usbguard_exit(void)
+{
+    struct usbguard_dev *dev;
+    struct port_count *pc;
+    struct hlist_node *tmp;
+    unsigned long key;
+    int bkt;
+
+    usb_deregister(&usbguard_driver);
+    debugfs_remove_recursive(usbguard_debugfs);
+    sysfs_remove_group(usbguard_kobj, &usbguard_group);
+    kobject_put(usbguard_kobj);
+    if (fw_dev)
+        root_device_unregister(fw_dev);
+    cancel_delayed_work_sync(&grant_work);
+    /* no more publishes; the sweep needs the notifier to drop gone devices */
+    cancel_work_sync(&reeval_work);
+    usb_unregister_notify(&usbguard_nb);
+
+    xa_for_each(&devices, key, dev)
+        kfree(xa_erase(&devices, key));
+    xa_destroy(&devices);
+    hash_for_each_safe(port_counts, bkt, tmp, pc, node)
+        kfree(pc);
+    kvfree(snapshot_img.data);
+
+    /* wait for retired snapshots before freeing the live one */
+    rcu_barrier();
+    policy_free(rcu_dereference_protected(policy, 1));
+    pr_info("usbguard: demo module unloaded\n");
+}
+
+#if defined(USBGUARD_KUNIT) && IS_ENABLED(CONFIG_KUNIT)
+#include "usbguard_kunit.c"
+#endif
+
+module_init(usbguard_init);
+module_exit(usbguard_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("pnasis");
+MODULE_DESCRIPTION("USB Device Guard with Rule File Loading");
@@ -0,0 +1,506 @@
+/*
+ * usbguard_shim.h - kernel APIs used by the policy core
+ *
+ * In the kernel this only pulls in the real headers. In userspace it
+ * provides minimal equivalents so usbguard_core.c builds unchanged for
+ * benchmarking, testing and debugging.
+ */
+#ifndef USBGUARD_SHIM_H
+#define USBGUARD_SHIM_H
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/ctype.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/log2.h>
+#include <linux/overflow.h>
+#include <linux/xxhash.h>
+#include <linux/err.h>
+#include <linux/printk.h>
+#include <linux/jiffies.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/byteorder/generic.h>
+
+#else /* userspace */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;   /* as in the kernel, for printk formats */
+typedef long long s64;
+
+/* Byte order of snapshot images; like xxh64 below, assumes a little-endian host */
+typedef uint16_t __le16;
+typedef uint32_t __le32;
+typedef uint64_t __le64;
+
+#define cpu_to_le16(x) ((__le16)(x))
+#define cpu_to_le32(x) ((__le32)(x))
+#define cpu_to_le64(x) ((__le64)(x))
+#define le16_to_cpu(x) ((u16)(x))
+#define le32_to_cpu(x) ((u32)(x))
+#define le64_to_cpu(x) ((u64)(x))
+
+#define GFP_KERNEL 0
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define max3(a, b, c) max(max(a, b), c)
+#define max_t(type, a, b) max((type)(a), (type)(b))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define BITS_PER_LONG (8 * sizeof(long))
+#define BITS_TO_LONGS(n) DIV_ROUND_UP(n, BITS_PER_LONG)
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((__typeof__(x))(a) - 1))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+static inline __attribute__((format(printf, 1, 2))) void pr_info(const char *fmt, ...)
+{
+}
+
+/* Error codes in pointers, as <linux/err.h> */
+#define MAX_ERRNO 4095
+
+static inline void *ERR_PTR(long error)
+{
+    return (void *)error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+    return (long)ptr;
+}
+
+static inline bool IS_ERR(const void *ptr)
+{
+    return (unsigned long)ptr >= (unsigned long)-MAX_ERRNO;
+}
+
+/* jiffies run at 1 kHz on the monotonic clock */
+#define HZ 1000
+
+static inline u64 get_jiffies_64(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * HZ + ts.tv_nsec / (1000000000 / HZ);
+}
+
+#define time_after64(a, b) ((s64)((b) - (a)) < 0)
+#define time_before64(a, b) time_after64(b, a)
+
+/* Only retired through call_rcu() in the kernel */
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+/* ctype on a plain char is undefined for bytes >= 0x80 */
+#undef isspace
+#define isspace(c) (isspace)((unsigned char)(c))
+
+typedef struct { long counter; } atomic_long_t;
+
+static inline long atomic_long_read(const atomic_long_t *v)
+{
+    return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_long_set(atomic_long_t *v, long i)
+{
+    __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_long_inc(atomic_long_t *v)
+{
+    __atomic_fetch_add(&v->counter, 1, __ATOMIC_RELAXED);
+}
+
+static inline size_t array_size(size_t a, size_t b)
+{
+    size_t n;
+
+    return __builtin_mul_overflow(a, b, &n) ? SIZE_MAX : n;
+}
+
+#ifdef USBGUARD_FAULT_INJECT
+/* Set by tests to fail the nth allocation from now on (1 fails the next one) */
+extern unsigned long shim_fail_nth;
+
+static inline bool shim_alloc_fails(void)
+{
+    return shim_fail_nth && !--shim_fail_nth;
+}
+#else
+static inline bool shim_alloc_fails(void)
+{
+    return false;
+}
+#endif
+
+static inline void *kvmalloc(size_t n, int gfp)
+{
+    return shim_alloc_fails() ? NULL : malloc(n);
+}
+
+static inline void *kvmalloc_array(size_t n, size_t size, int gfp)
+{
+    return shim_alloc_fails() ? NULL : malloc(array_size(n, size));
+}
+
+static inline void *kvcalloc(size_t n, size_t size, int gfp)
+{
+    return shim_alloc_fails() ? NULL : calloc(n, size);
+}
+
+static inline void *kmemdup(const void *src, size_t n, int gfp)
+{
+    void *p = shim_alloc_fails() ? NULL : malloc(n);
+
+    return p ? memcpy(p, src, n) : NULL;
+}
+
+static inline void *kzalloc(size_t n, int gfp)
+{
+    return kvcalloc(1, n, gfp);
+}
+
+static inline void *krealloc_array(void *p, size_t n, size_t size, int gfp)
+{
+    return shim_alloc_fails() ? NULL : realloc(p, array_size(n, size));
+}
+
+#define kvmemdup kmemdup
+#define kvzalloc kzalloc
+#define kfree free
+#define kvfree free
+
+/* Copy with truncation; -E2BIG when src did not fit */
+static inline long strscpy(char *dst, const char *src, size_t size)
+{
+    size_t len = strnlen(src, size);
+
+    if (!size) return -E2BIG;
+    if (len == size) {
+        memcpy(dst, src, size - 1);
+        dst[size - 1] = '\0';
+        return -E2BIG;
+    }
+    memcpy(dst, src, len + 1);
+    return len;
+}
+
+static inline int hweight16(unsigned int w)
+{
+    return __builtin_popcount(w & 0xFFFF);
+}
+
+#define ilog2(n) (63 - __builtin_clzll(n))
+
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+    return n <= 1 ? 1 : 1UL << (8 * sizeof(long) - __builtin_clzl(n - 1));
+}
+
+static inline void __set_bit(unsigned long nr, unsigned long *addr)
+{
+    addr[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline bool test_bit(unsigned long nr, const unsigned long *addr)
+{
+    return addr[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG) & 1;
+}
+
+static inline char *skip_spaces(const char *s)
+{
+    while (isspace(*s))
+        s++;
+    return (char *)s;
+}
+
+/* Like the kernel's: no sign or leading space, optional "0x", one trailing newline */
+static inline int kstrtoull(const char *s, unsigned int base, unsigned long long *res)
+{
+    char *end;
+
+    if (!isxdigit(*s) && !(s[0] == '0' && (s[1] | 0x20) == 'x'))
+        return -EINVAL;
+    errno = 0;
+    *res = strtoull(s, &end, base);
+    if (errno) return -ERANGE;
+    if (end == s || (*end && !(end[0] == '\n' && !end[1]))) return -EINVAL;
+    return 0;
+}
+
+static inline int kstrtou64(const char *s, unsigned int base, u64 *res)
+{
+    unsigned long long v;
+    int rc = kstrtoull(s, base, &v);
+
+    if (!rc) *res = v;
+    return rc;
+}
+
+static inline int kstrtou32(const char *s, unsigned int base, u32 *res)
+{
+    unsigned long long v;
+    int rc = kstrtoull(s, base, &v);
+
+    if (rc) return rc;
+    if (v > 0xFFFFFFFF) return -ERANGE;
+    *res = v;
+    return 0;
+}
+
+static inline int kstrtou8(const char *s, unsigned int base, u8 *res)
+{
+    unsigned long long v;
+    int rc = kstrtoull(s, base, &v);
+
+    if (rc) return rc;
+    if (v > 0xFF) return -ERANGE;
+    *res = v;
+    return 0;
+}
+
+static inline int kstrtou16(const char *s, unsigned int base, u16 *res)
+{
+    unsigned long long v;
+    int rc = kstrtoull(s, base, &v);
+
+    if (rc) return rc;
+    if (v > 0xFFFF) return -ERANGE;
+    *res = v;
+    return 0;
+}
+
+/* Hash lists and fixed-size hash tables, as <linux/list.h> and <linux/hashtable.h> */
+struct hlist_node {
+    struct hlist_node *next, **pprev;
+};
+
+struct hlist_head {
+    struct hlist_node *first;
+};
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+    n->next = h->first;
+    if (h->first) h->first->pprev = &n->next;
+    h->first = n;
+    n->pprev = &h->first;
+}
+
+static inline void hlist_del_init(struct hlist_node *n)
+{
+    if (!n->pprev) return;
+    *n->pprev = n->next;
+    if (n->next) n->next->pprev = n->pprev;
+    n->next = NULL;
+    n->pprev = NULL;
+}
+
+#define hlist_entry_safe(ptr, type, member) \
+    ({ __typeof__(ptr) ____ptr = (ptr); ____ptr ? container_of(____ptr, type, member) : NULL; })
+
+#define hlist_for_each_entry(pos, head, member)                                     \
+    for (pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member); pos;    \
+         pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), member))
+
+#define hlist_for_each_entry_safe(pos, n, head, member)                             \
+    for (pos = hlist_entry_safe((head)->first, __typeof__(*pos), member);           \
+         pos && ({ n = pos->member.next; 1; });                                     \
+         pos = hlist_entry_safe(n, __typeof__(*pos), member))
+
+#define GOLDEN_RATIO_32 0x61C88647
+
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+    return val * GOLDEN_RATIO_32 >> (32 - bits);
+}
+
+#define DECLARE_HASHTABLE(name, bits) struct hlist_head name[1 << (bits)]
+#define HASH_SIZE(name) ARRAY_SIZE(name)
+#define HASH_BITS(name) ilog2(HASH_SIZE(name))
+#define hash_init(name) memset(name, 0, sizeof(name))
+#define hash_add(name, node, key) hlist_add_head(node, &name[hash_32(key, HASH_BITS(name))])
+#define hash_del(node) hlist_del_init(node)
+
+#define hash_for_each(name, bkt, obj, member)                                       \
+    for ((bkt) = 0, obj = NULL; obj == NULL && (bkt) < HASH_SIZE(name); (bkt)++)    \
+        hlist_for_each_entry(obj, &name[bkt], member)
+
+#define hash_for_each_safe(name, bkt, tmp, obj, member)                             \
+    for ((bkt) = 0, obj = NULL; obj == NULL && (bkt) < HASH_SIZE(name); (bkt)++)    \
+        hlist_for_each_entry_safe(obj, tmp, &name[bkt], member)
+
+#define hash_for_each_possible(name, obj, member, key) \
+    hlist_for_each_entry(obj, &name[hash_32(key, HASH_BITS(name))], member)
+
+/* jhash, as <linux/jhash.h> */
+static inline u32 jhash_rol32(u32 word, unsigned int shift)
+{
+    return word << shift | word >> ((-shift) & 31);
+}
+
+#define __jhash_mix(a, b, c)                                        \
+    do {                                                            \
+        a -= c; a ^= jhash_rol32(c, 4); c += b;                     \
+        b -= a; b ^= jhash_rol32(a, 6); a += c;                     \
+        c -= b; c ^= jhash_rol32(b, 8); b += a;                     \
+        a -= c; a ^= jhash_rol32(c, 16); c += b;                    \
+        b -= a; b ^= jhash_rol32(a, 19); a += c;                    \
+        c -= b; c ^= jhash_rol32(b, 4); b += a;                     \
+    } while (0)
+
+#define __jhash_final(a, b, c)                                      \
+    do {                                                            \
+        c ^= b; c -= jhash_rol32(b, 14);                            \
+        a ^= c; a -= jhash_rol32(c, 11);                            \
+        b ^= a; b -= jhash_rol32(a, 25);                            \
+        c ^= b; c -= jhash_rol32(b, 16);                            \
+        a ^= c; a -= jhash_rol32(c, 4);                             \
+        b ^= a; b -= jhash_rol32(a, 14);                            \
+        c ^= b; c -= jhash_rol32(b, 24);                            \
+    } while (0)
+
+static inline u32 jhash(const void *key, u32 length, u32 initval)
+{
+    const u8 *k = key;
+    u32 a, b, c;
+
+    a = b = c = 0xdeadbeef + length + initval;
+    while (length > 12) {
+        a += k[0] + ((u32)k[1] << 8) + ((u32)k[2] << 16) + ((u32)k[3] << 24);
+        b += k[4] + ((u32)k[5] << 8) + ((u32)k[6] << 16) + ((u32)k[7] << 24);
+        c += k[8] + ((u32)k[9] << 8) + ((u32)k[10] << 16) + ((u32)k[11] << 24);
+        __jhash_mix(a, b, c);
+        length -= 12;
+        k += 12;
+    }
+    switch (length) {
+    case 12: c += (u32)k[11] << 24; /* fall through */
+    case 11: c += (u32)k[10] << 16; /* fall through */
+    case 10: c += (u32)k[9] << 8;   /* fall through */
+    case 9:  c += k[8];             /* fall through */
+    case 8:  b += (u32)k[7] << 24;  /* fall through */
+    case 7:  b += (u32)k[6] << 16;  /* fall through */
+    case 6:  b += (u32)k[5] << 8;   /* fall through */
+    case 5:  b += k[4];             /* fall through */
+    case 4:  a += (u32)k[3] << 24;  /* fall through */
+    case 3:  a += (u32)k[2] << 16;  /* fall through */
+    case 2:  a += (u32)k[1] << 8;   /* fall through */
+    case 1:  a += k[0];
+        __jhash_final(a, b, c);
+        break;
+    case 0:
+        break;
+    }
+    return c;
+}
+
+/* XXH64, as lib/xxhash.c; assumes a little-endian host */
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline u64 xxh_rotl64(u64 x, int r)
+{
+    return x << r | x >> (64 - r);
+}
+
+static inline u64 xxh_read64(const u8 *p)
+{
+    u64 v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline u32 xxh_read32(const u8 *p)
+{
+    u32 v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline u64 xxh64_round(u64 acc, u64 input)
+{
+    acc += input * XXH_P2;
+    return xxh_rotl64(acc, 31) * XXH_P1;
+}
+
+static inline u64 xxh64_merge_round(u64 acc, u64 val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static inline u64 xxh64(const void *input, size_t len, u64 seed)
+{
+    const u8 *p = input, *end = p + len;
+    u64 h;
+
+    if (len >= 32) {
+        u64 v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2;
+        u64 v3 = seed, v4 = seed - XXH_P1;
+
+        do {
+            v1 = xxh64_round(v1, xxh_read64(p));
+            v2 = xxh64_round(v2, xxh_read64(p + 8));
+            v3 = xxh64_round(v3, xxh_read64(p + 16));
+            v4 = xxh64_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+
+        h = xxh_rotl64(v1, 1) + xxh_rotl64(v2, 7) + xxh_rotl64(v3, 12) + xxh_rotl64(v4, 18);
+        h = xxh64_merge_round(h, v1);
+        h = xxh64_merge_round(h, v2);
+        h = xxh64_merge_round(h, v3);
+        h = xxh64_merge_round(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+
+    h += len;
+    for (; p + 8 <= end; p += 8)
+        h = xxh_rotl64(h ^ xxh64_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end) {
+        h = xxh_rotl64(h ^ (u64)xxh_read32(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = xxh_rotl64(h ^ *p * XXH_P5, 11) * XXH_P1;
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+#endif /* __KERNEL__ */
+
+#endif /* USBGUARD_SHIM_H */
@@ -0,0 +1,776 @@
+/*
+ * usbguard_test.c - userspace unit tests of the policy core
+ *
+ * Builds usbguard_core.c outside the kernel (make test) with the debug
+ * invariant checks and allocation fault injection, and checks the rule
+ * parser, the range, fingerprint and serial tables, and how the sysfs
+ * store path splits a write into the module's line handlers and stops on
+ * ENOSPC and ENOMEM. Policy diffs go through every kind of line and a
+ * snapshot round trip.
+ *
+ * Usage: usbguard-test [seed]
+ */
+#include <stdio.h>
+
+#include "usbguard_core.h"
+
+unsigned long shim_fail_nth;
+
+static int checks, failures;
+
+#define EXPECT(cond)                                                        \
+    do {                                                                    \
+        checks++;                                                           \
+        if (!(cond)) {                                                      \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);      \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+#define EXPECT_RC(expr, want)                                               \
+    do {                                                                    \
+        int rc_ = (expr);                                                   \
+                                                                            \
+        checks++;                                                           \
+        if (rc_ != (want)) {                                                \
+            fprintf(stderr, "%s:%d: %s = %d, want %d\n", __FILE__, __LINE__, \
+                    #expr, rc_, (want));                                    \
+            failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+#define KEY(vid, pid) ((u32)(vid) << 16 | (pid))
+
+/* Parse a rule from a string literal; the parser needs a writable copy */
+static int parse(const char *text, struct vidpid *rule)
+{
+    char line[64];
+
+    snprintf(line, sizeof(line), "%s", text);
+    return parse_vidpid_line(line, rule);
+}
+
+static int update(struct ruleset *set, const char *text, bool remove)
+{
+    struct vidpid rule;
+    int rc = parse(text, &rule);
+
+    return rc ? rc : ruleset_update(set, &rule, remove);
+}
+
+static bool has_range(const struct ruleset *set, size_t i, u32 lo, u32 hi)
+{
+    return i < set->count && set->ranges[i].lo == lo && set->ranges[i].hi == hi;
+}
+
+static void test_trim(void)
+{
+    char a[] = "  046d c52b \t\n", b[] = " \t\n", c[] = "", d[] = "x";
+    char e[] = "  a  b # c", *p = e;
+
+    EXPECT(!strcmp(trim(a), "046d c52b"));
+    EXPECT(!strcmp(trim(b), ""));
+    EXPECT(!strcmp(trim(c), ""));
+    EXPECT(!strcmp(trim(d), "x"));
+
+    EXPECT(!strcmp(next_token(&p), "a"));
+    EXPECT(!strcmp(next_token(&p), "b"));
+    EXPECT(next_token(&p) == NULL);
+}
+
+static void test_parse_vidpid(void)
+{
+    struct vidpid r;
+
+    EXPECT_RC(parse("046d c52b", &r), 0);
+    EXPECT(r.vid == 0x046d && r.pid == 0xc52b && r.pid_hi == 0xc52b && r.mask == 0xFFFF);
+    EXPECT_RC(parse("  046D C52B  \n", &r), 0);
+    EXPECT(r.vid == 0x046d && r.pid == 0xc52b);
+    EXPECT_RC(parse("046d c52b # mouse", &r), 0);
+
+    EXPECT_RC(parse("1234 0010-0020", &r), 0);
+    EXPECT(r.pid == 0x10 && r.pid_hi == 0x20 && r.mask == 0xFFFF);
+    EXPECT_RC(parse("1234 0010-0010", &r), 0);
+    EXPECT_RC(parse("1234 0020-0010", &r), -EINVAL);
+    EXPECT_RC(parse("1234 0010-", &r), -EINVAL);
+
+    EXPECT_RC(parse("1234 12ff/ff00", &r), 0);
+    EXPECT(r.pid == 0x1200 && r.pid_hi == 0x1200 && r.mask == 0xff00);
+    EXPECT_RC(parse("1234 0001/", &r), -EINVAL);
+
+    EXPECT_RC(parse("", &r), -EINVAL);
+    EXPECT_RC(parse("   ", &r), -EINVAL);
+    EXPECT_RC(parse("# comment", &r), -EINVAL);
+    EXPECT_RC(parse("046d", &r), -EINVAL);
+    EXPECT_RC(parse("046d c52b extra", &r), -EINVAL);
+    EXPECT_RC(parse("zzzz 0001", &r), -EINVAL);
+    EXPECT_RC(parse("046d -001", &r), -EINVAL);
+    EXPECT_RC(parse("+46d 0001", &r), -EINVAL);
+    EXPECT_RC(parse("10000 0001", &r), -ERANGE);
+    EXPECT_RC(parse("0001 10000", &r), -ERANGE);
+}
+
+static void test_parse_fingerprint(void)
+{
+    char ok[] = " fp 0123456789ABCDEF ", zero[] = "fp 0", bare[] = "fp";
+    char extra[] = "fp 1 2", word[] = "fq 1", big[] = "fp 10000000000000000";
+    u64 fp;
+
+    EXPECT_RC(parse_fingerprint_line(ok, &fp), 0);
+    EXPECT(fp == 0x0123456789abcdefULL);
+    EXPECT_RC(parse_fingerprint_line(zero, &fp), -EINVAL);
+    EXPECT_RC(parse_fingerprint_line(bare, &fp), -EINVAL);
+    EXPECT_RC(parse_fingerprint_line(extra, &fp), -EINVAL);
+    EXPECT_RC(parse_fingerprint_line(word, &fp), -EINVAL);
+    EXPECT_RC(parse_fingerprint_line(big, &fp), -ERANGE);
+}
+
+static void test_ranges(void)
+{
+    struct ruleset set = {0}, copy;
+
+    /* touching and overlapping ranges merge and add up their hits */
+    EXPECT_RC(update(&set, "1000 0001", false), 0);
+    EXPECT(ruleset_match(&set, KEY(0x1000, 1)));
+    EXPECT_RC(update(&set, "1000 0002", false), 0);
+    EXPECT(set.count == 1 && has_range(&set, 0, KEY(0x1000, 1), KEY(0x1000, 2)));
+    EXPECT(atomic_long_read(&set.hits[0]) == 1);
+    EXPECT_RC(update(&set, "1000 0010-0020", false), 0);
+    EXPECT_RC(update(&set, "1000 0003-0012", false), 0);
+    EXPECT(set.count == 1 && has_range(&set, 0, KEY(0x1000, 1), KEY(0x1000, 0x20)));
+    EXPECT(atomic_long_read(&set.hits[0]) == 1);
+
+    /* ranges never merge across a VID */
+    EXPECT_RC(update(&set, "0fff ffff", false), 0);
+    EXPECT_RC(update(&set, "1000 0000", false), 0);
+    EXPECT(set.count == 2 && has_range(&set, 1, KEY(0x1000, 0), KEY(0x1000, 0x20)));
+    EXPECT_RC(ruleset_check(&set), 0);
+
+    /* removal trims, splits and spans ranges */
+    EXPECT_RC(update(&set, "1000 0008-0009", true), 0);
+    EXPECT(set.count == 3 && has_range(&set, 1, KEY(0x1000, 0), KEY(0x1000, 7)) &&
+           has_range(&set, 2, KEY(0x1000, 0xa), KEY(0x1000, 0x20)));
+    EXPECT(!ruleset_match(&set, KEY(0x1000, 8)) && ruleset_match(&set, KEY(0x1000, 0xa)));
+    EXPECT_RC(update(&set, "1000 0000", true), 0);
+    EXPECT(has_range(&set, 1, KEY(0x1000, 1), KEY(0x1000, 7)));
+    EXPECT_RC(update(&set, "1000 0005-0010", true), 0);
+    EXPECT(set.count == 3 && has_range(&set, 1, KEY(0x1000, 1), KEY(0x1000, 4)) &&
+           has_range(&set, 2, KEY(0x1000, 0x11), KEY(0x1000, 0x20)));
+    EXPECT_RC(update(&set, "1000 0008", true), -ENOENT);
+    EXPECT_RC(update(&set, "2000 0001", true), -ENOENT);
+    EXPECT_RC(ruleset_check(&set), 0);
+
+    /* a copy is independent of the original */
+    EXPECT_RC(ruleset_copy(&copy, &set), 0);
+    EXPECT_RC(update(&copy, "0fff ffff", true), 0);
+    EXPECT(copy.count == 2 && set.count == 3);
+    ruleset_free(&copy);
+
+    EXPECT_RC(update(&set, "0fff ffff", true), 0);
+    EXPECT_RC(update(&set, "1000 0000-ffff", true), 0);
+    EXPECT(set.count == 0);
+    ruleset_free(&set);
+}
+
+static void test_masks(void)
+{
+    struct ruleset set = {0};
+    struct vidpid r;
+    u32 pid;
+
+    /* clear bits at the bottom: one range */
+    EXPECT_RC(update(&set, "1234 0000/fff0", false), 0);
+    EXPECT(set.count == 1 && has_range(&set, 0, KEY(0x1234, 0), KEY(0x1234, 0xf)));
+    EXPECT_RC(update(&set, "1234 0000/fff0", true), 0);
+    EXPECT(set.count == 0);
+
+    /* clear bits in the middle: one range per combination */
+    EXPECT_RC(update(&set, "1234 0001/ff0f", false), 0);
+    EXPECT(set.count == 16);
+    for (pid = 0; pid < 0x200; pid++)
+        EXPECT(ruleset_match(&set, KEY(0x1234, pid)) == ((pid & 0xff0f) == 1));
+    EXPECT_RC(ruleset_check(&set), 0);
+
+    /* removing a wider mask splits every sub-range it covers */
+    EXPECT_RC(update(&set, "1234 0000/0000", false), 0);
+    EXPECT(set.count == 1);
+    EXPECT_RC(update(&set, "1234 0001/ff0f", true), 0);
+    EXPECT(set.count == 17);
+    EXPECT(!ruleset_match(&set, KEY(0x1234, 0x31)) && ruleset_match(&set, KEY(0x1234, 0x32)));
+    EXPECT_RC(ruleset_check(&set), 0);
+
+    /* more than MASK_RANGES_MAX sub-ranges */
+    EXPECT_RC(parse("1234 0000/007f", &r), 0);
+    EXPECT_RC(ruleset_update(&set, &r, false), -E2BIG);
+    ruleset_free(&set);
+}
+
+/* A table with MAX_RULES single-PID ranges that cannot merge */
+static void fill_table(struct ruleset *set)
+{
+    u32 i;
+
+    for (i = 0; i < MAX_RULES; i++)
+        ruleset_add_range(set, KEY(0x2000, i * 2), KEY(0x2000, i * 2));
+}
+
+static void test_full_table(void)
+{
+    struct ruleset set = {0};
+    struct vidpid r;
+
+    fill_table(&set);
+    EXPECT(set.count == MAX_RULES);
+
+    /* adds fail without touching the table */
+    EXPECT_RC(update(&set, "3000 0001", false), -ENOSPC);
+    EXPECT_RC(update(&set, "3000 0000/fffe", false), -ENOSPC);
+    EXPECT(set.count == MAX_RULES && !ruleset_match(&set, KEY(0x3000, 0)));
+
+    /* merging into an existing range needs no slot */
+    EXPECT_RC(update(&set, "2000 0001", false), 0);
+    EXPECT(set.count == MAX_RULES - 1);
+    EXPECT_RC(update(&set, "3000 0001", false), 0);
+    EXPECT(set.count == MAX_RULES);
+
+    /* mask removals that split nothing work on a full table */
+    EXPECT_RC(update(&set, "2000 0004/fffe", true), 0);
+    EXPECT(set.count == MAX_RULES - 1);
+    EXPECT_RC(update(&set, "3000 0000/fffe", true), 0);
+    EXPECT(set.count == MAX_RULES - 2);
+
+    /* a mask add that needs more slots than are left fails as a whole */
+    EXPECT_RC(parse("4000 0001/fcff", &r), 0);
+    EXPECT_RC(ruleset_update(&set, &r, false), -ENOSPC);
+    EXPECT(set.count == MAX_RULES - 2 && !ruleset_match(&set, KEY(0x4000, 1)));
+
+    /* so does a removal that has to split more ranges than fit */
+    EXPECT_RC(update(&set, "5000 0000-ffff", false), 0);
+    EXPECT_RC(update(&set, "5000 0001/fcff", true), -ENOSPC);
+    EXPECT(ruleset_match(&set, KEY(0x5000, 1)) && ruleset_match(&set, KEY(0x5000, 0x101)));
+    EXPECT_RC(ruleset_check(&set), 0);
+    ruleset_free(&set);
+}
+
+static void test_ranges_enomem(void)
+{
+    struct ruleset set = {0}, copy;
+    unsigned long n;
+    int rc;
+
+    EXPECT_RC(update(&set, "1000 0001", false), 0);
+    /* fail each allocation of a growing add in turn */
+    for (n = 1; n <= 2; n++) {
+        while (set.count < set.cap)
+            ruleset_add_range(&set, KEY(0x1001, set.count * 2), KEY(0x1001, set.count * 2));
+        shim_fail_nth = n;
+        rc = update(&set, "2000 0001", false);
+        shim_fail_nth = 0;
+        EXPECT_RC(rc, -ENOMEM);
+        EXPECT(!ruleset_match(&set, KEY(0x2000, 1)));
+        EXPECT_RC(ruleset_check(&set), 0);
+    }
+
+    shim_fail_nth = 2;
+    EXPECT_RC(ruleset_copy(&copy, &set), -ENOMEM);
+    shim_fail_nth = 0;
+    EXPECT(copy.ranges == NULL && copy.count == 0);
+    ruleset_free(&set);
+}
+
+static void test_fingerprints(void)
+{
+    struct fp_set set = {0}, copy;
+    u64 base = 0x1234567800000000ULL;
+    u32 i;
+
+    EXPECT(!fp_set_match(&set, 1));
+    EXPECT(!fp_set_remove(&set, 1));
+
+    /* a probe chain that wraps around the end of the table */
+    EXPECT_RC(fp_set_add(&set, base + 63), 0);
+    EXPECT(set.mask == FP_SET_MIN - 1);
+    EXPECT_RC(fp_set_add(&set, base + 63 + 64), 0);
+    EXPECT_RC(fp_set_add(&set, base + 64 * 2), 0);
+    EXPECT_RC(fp_set_add(&set, base + 63 + 64 * 3), 0);
+    EXPECT_RC(fp_set_add(&set, base + 1), 0);
+    EXPECT_RC(fp_set_add(&set, base + 1), 0);
+    EXPECT(set.count == 5);
+    EXPECT(set.slots[63] == base + 63 && set.slots[0] == base + 63 + 64 &&
+           set.slots[1] == base + 128 && set.slots[2] == base + 63 + 192 &&
+           set.slots[3] == base + 1);
+    EXPECT(fp_set_match(&set, base + 63 + 64 * 3));
+
+    /* deleting the head shifts the chain back, hit counts included */
+    EXPECT(fp_set_remove(&set, base + 63));
+    EXPECT(set.slots[63] == base + 63 + 64 && set.slots[0] == base + 128 &&
+           set.slots[1] == base + 63 + 192 && set.slots[2] == base + 1 && !set.slots[3]);
+    EXPECT(atomic_long_read(&set.hits[1]) == 1);
+    EXPECT(!fp_set_match(&set, base + 63));
+    EXPECT_RC(fp_set_check(&set), 0);
+
+    /* deleting mid-chain leaves an entry that is already home in place */
+    EXPECT(fp_set_remove(&set, base + 128));
+    EXPECT(set.slots[0] == base + 63 + 192 && set.slots[1] == base + 1);
+    EXPECT(fp_set_match(&set, base + 1) && fp_set_match(&set, base + 63 + 64));
+    EXPECT(!fp_set_remove(&set, base + 128));
+    EXPECT_RC(fp_set_check(&set), 0);
+
+    /* growth keeps every entry */
+    for (i = 0; i < 200; i++)
+        EXPECT_RC(fp_set_add(&set, base + 0x1000 + i * 7), 0);
+    EXPECT(set.count == 203 && set.mask + 1 >= 512);
+    for (i = 0; i < 200; i++)
+        EXPECT(fp_set_match(&set, base + 0x1000 + i * 7));
+    EXPECT_RC(fp_set_check(&set), 0);
+
+    EXPECT_RC(fp_set_copy(&copy, &set), 0);
+    EXPECT(fp_set_remove(&copy, base + 1) && fp_set_match(&set, base + 1));
+    fp_set_free(&copy);
+
+    /* a failed growth keeps the old table */
+    while ((set.count + 1) * 2 <= set.mask + 1)
+        EXPECT_RC(fp_set_add(&set, base + 0x100000 + set.count), 0);
+    for (i = 1; i <= 2; i++) {
+        shim_fail_nth = i;
+        EXPECT_RC(fp_set_add(&set, base + 0x200000), -ENOMEM);
+        shim_fail_nth = 0;
+        EXPECT(!fp_set_match(&set, base + 0x200000) && fp_set_match(&set, base + 1));
+        EXPECT_RC(fp_set_check(&set), 0);
+    }
+    fp_set_free(&set);
+}
+
+static struct serial_ref *find(const struct serial_set *set, const char *s)
+{
+    return serial_find(set, s, strlen(s));
+}
+
+static void test_serials(void)
+{
+    struct serial_set set = {0}, copy;
+    struct serial_ref *ref;
+    char s[16];
+    u32 i, n;
+
+    EXPECT(!find(&set, "ABC"));
+    EXPECT_RC(serial_set_add(&set, "ABC", 3), 0);
+    EXPECT_RC(serial_set_add(&set, "ABCD", 4), 0);
+    EXPECT(find(&set, "ABC") && find(&set, "ABCD"));
+    EXPECT(!find(&set, "AB") && !find(&set, "abc"));
+
+    for (i = 0; i < MAX_SERIALS - 2; i++) {
+        snprintf(s, sizeof(s), "SN%08x", i);
+        EXPECT_RC(serial_set_add(&set, s, strlen(s)), 0);
+    }
+    EXPECT(set.count == MAX_SERIALS);
+    EXPECT_RC(serial_set_check(&set), 0);
+
+    /* removal only marks the serial and keeps the other hit counts */
+    ref = find(&set, "ABCD");
+    atomic_long_set(&ref->hits, 5);
+    EXPECT_RC(serial_set_remove(&set, find(&set, "ABC")), 0);
+    EXPECT(!find(&set, "ABC") && set.count == MAX_SERIALS - 1 && set.nr_refs == MAX_SERIALS);
+    EXPECT(atomic_long_read(&find(&set, "ABCD")->hits) == 5);
+    for (i = 0; i < MAX_SERIALS - 2; i++) {
+        snprintf(s, sizeof(s), "SN%08x", i);
+        EXPECT(find(&set, s));
+    }
+    EXPECT_RC(serial_set_check(&set), 0);
+
+    /* and blocking it again appends it */
+    EXPECT_RC(serial_set_add(&set, "ABC", 3), 0);
+    EXPECT(find(&set, "ABC") && set.count == MAX_SERIALS && set.nr_refs == MAX_SERIALS + 1);
+    EXPECT_RC(serial_set_remove(&set, find(&set, "ABC")), 0);
+    EXPECT_RC(serial_set_check(&set), 0);
+
+    EXPECT_RC(serial_set_copy(&copy, &set), 0);
+    EXPECT_RC(serial_set_remove(&copy, find(&copy, "ABCD")), 0);
+    EXPECT(!find(&copy, "ABCD") && find(&set, "ABCD"));
+    EXPECT_RC(serial_set_check(&copy), 0);
+    serial_set_free(&copy);
+
+    /* once removed ones outnumber the rest, the set is rebuilt packed */
+    for (i = 0; set.nr_refs > set.count; i++) {
+        snprintf(s, sizeof(s), "SN%08x", i);
+        EXPECT_RC(serial_set_remove(&set, find(&set, s)), 0);
+    }
+    EXPECT(set.count == MAX_SERIALS - 1 - i && set.refs_cap < MAX_SERIALS);
+    EXPECT(set.arena_len == 4 + (set.count - 1) * 10);
+    EXPECT(atomic_long_read(&find(&set, "ABCD")->hits) == 5);
+    n = i;
+    for (i = 0; i < MAX_SERIALS - 2; i++) {
+        snprintf(s, sizeof(s), "SN%08x", i);
+        EXPECT(!find(&set, s) == (i < n));
+    }
+    EXPECT_RC(serial_set_check(&set), 0);
+    serial_set_free(&set);
+
+    /* a rebuild that runs out of memory leaves the marks for the next one */
+    for (i = 0; i < 40; i++) {
+        snprintf(s, sizeof(s), "F%02u", i);
+        EXPECT_RC(serial_set_add(&set, s, 3), 0);
+    }
+    for (i = 0; i < 21; i++) {
+        snprintf(s, sizeof(s), "F%02u", i);
+        shim_fail_nth = 1;
+        EXPECT_RC(serial_set_remove(&set, find(&set, s)), 0);
+        shim_fail_nth = 0;
+    }
+    EXPECT(set.count == 19 && set.nr_refs == 40 && !find(&set, "F20") && find(&set, "F21"));
+    EXPECT_RC(serial_set_check(&set), 0);
+    EXPECT_RC(serial_set_remove(&set, find(&set, "F21")), 0);
+    EXPECT(set.count == 18 && set.nr_refs == 18 && find(&set, "F39"));
+    EXPECT_RC(serial_set_check(&set), 0);
+    serial_set_free(&set);
+}
+
+/* The sysfs store path: the module's line handlers on a test policy */
+static int rules_line(void *arg, char *line)
+{
+    return apply_rule_line(arg, line, "test");
+}
+
+static int blocked_line(void *arg, char *line)
+{
+    return apply_blocked_line(arg, line);
+}
+
+static int diff_line(void *arg, char *line)
+{
+    return apply_diff_line(arg, line);
+}
+
+/* Apply one diff line from a string literal */
+static int diff(struct usbguard_policy *pol, const char *text)
+{
+    char line[RULE_LINE_MAX];
+
+    snprintf(line, sizeof(line), "%s", text);
+    return apply_diff_line(pol, line);
+}
+
+static int store(struct usbguard_policy *pol, int (*apply)(void *, char *), const char *text,
+                 size_t *done, size_t *accepted)
+{
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "%s", text);
+    return apply_lines(buf, strlen(text), apply, pol, done, accepted);
+}
+
+static void test_store(void)
+{
+    struct usbguard_policy *pol = policy_clone(NULL);
+    size_t done, accepted;
+    char s[16];
+    u32 i;
+
+    /* malformed lines, blanks and comments are skipped */
+    EXPECT_RC(store(pol, rules_line, "1000 0001\nbogus\n\n# c\n-1000 0001\n1000 0002",
+                    &done, &accepted), 0);
+    EXPECT(done == 41 && accepted == 3);
+    EXPECT(pol->rules.count == 1 && ruleset_match(&pol->rules, KEY(0x1000, 2)));
+
+    /* ENOSPC stops the write after the lines that fit */
+    ruleset_free(&pol->rules);
+    fill_table(&pol->rules);
+    EXPECT_RC(ruleset_update(&pol->rules, &(struct vidpid){ 0x2000, 0, 0, 0xFFFF }, true), 0);
+    EXPECT_RC(store(pol, rules_line, "3000 0001\n3000 0003\n-2000 0002\n", &done, &accepted),
+              -ENOSPC);
+    EXPECT(done == 10 && accepted == 1);
+    EXPECT(ruleset_match(&pol->rules, KEY(0x3000, 1)) &&
+           !ruleset_match(&pol->rules, KEY(0x3000, 3)));
+    EXPECT(ruleset_match(&pol->rules, KEY(0x2000, 2)));
+
+    /* ... and fails the write when not even the first line fits */
+    EXPECT_RC(store(pol, rules_line, "3000 0003\n", &done, &accepted), -ENOSPC);
+    EXPECT(done == 0 && accepted == 0);
+
+    /* ENOMEM works the same way */
+    ruleset_free(&pol->rules);
+    EXPECT_RC(store(pol, rules_line, "1000 0001\n", &done, &accepted), 0);
+    while (pol->rules.count < pol->rules.cap)
+        ruleset_add_range(&pol->rules, KEY(0x1001, pol->rules.count * 2),
+                          KEY(0x1001, pol->rules.count * 2));
+    shim_fail_nth = 1;
+    EXPECT_RC(store(pol, rules_line, "1000 0002\n2000 0001\n", &done, &accepted), -ENOMEM);
+    shim_fail_nth = 0;
+    EXPECT(done == 10 && accepted == 1 && !ruleset_match(&pol->rules, KEY(0x2000, 1)));
+    EXPECT_RC(policy_check(pol), 0);
+
+    /* blocked serials stop at MAX_SERIALS; re-blocking one is a no-op */
+    for (i = 0; i < MAX_SERIALS - 1; i++) {
+        snprintf(s, sizeof(s), "SN%08x", i);
+        EXPECT_RC(blocked_line(pol, s), 0);
+    }
+    EXPECT_RC(store(pol, blocked_line, "SN00000000\n  LAST  \nMORE\n", &done, &accepted),
+              -ENOSPC);
+    EXPECT(done == 20 && accepted == 2 && pol->serials.count == MAX_SERIALS);
+    EXPECT(find(&pol->serials, "LAST") && !find(&pol->serials, "MORE"));
+    EXPECT_RC(store(pol, blocked_line, "-LAST\n-MORE\n", &done, &accepted), 0);
+    EXPECT(accepted == 1 && !find(&pol->serials, "LAST"));
+    EXPECT_RC(policy_check(pol), 0);
+    policy_free(pol);
+}
+
+/* Every kind of diff line, then a snapshot round trip of the result */
+static const char diff_text[] =
+    "+1000 0001\n"
+    "1000 0010-001f\n"
+    "fp 0123456789abcdef\n"
+    "serial SN1\n"
+    "serial SN2\n"
+    "-serial SN1\n"
+    "@1-1 2000 0001\n"
+    "@1-1.2 2000 0002/fffe\n"
+    "%7 @1-1\n"
+    "%7 2000 0000-00ff\n"
+    "quota 08 2\n"
+    "quota @1-1 03 1\n"
+    "3000 0001 ttl=1h\n";
+
+/* A version 3 image with a view section: the view is skipped, the rest loads */
+static void test_old_views(void)
+{
+    struct {
+        struct snapshot_header hdr;
+        struct snapshot_range range;
+        struct snapshot_view view;
+        struct snapshot_range view_range;
+        char port[PORT_NAME_MAX];
+        __le32 nr_quotas;
+    } img = {};
+    struct usbguard_policy *pol = policy_clone(NULL);
+
+    img.hdr.magic = cpu_to_le32(SNAPSHOT_MAGIC);
+    img.hdr.version = cpu_to_le16(3);
+    img.hdr.nr_views = cpu_to_le16(1);
+    img.hdr.nr_ranges = cpu_to_le32(1);
+    img.range.lo = img.range.hi = cpu_to_le32(KEY(0x1000, 1));
+    img.view.ns = cpu_to_le32(7);
+    img.view.nr_ranges = cpu_to_le32(1);
+    img.view.nr_ports = cpu_to_le32(1);
+    img.view_range.lo = img.view_range.hi = cpu_to_le32(KEY(0x2000, 1));
+    strcpy(img.port, "1-1");
+    img.hdr.checksum = cpu_to_le64(xxh64(&img.hdr + 1, sizeof(img) - sizeof(img.hdr), 0));
+    EXPECT_RC(policy_import(pol, &img, sizeof(img)), 0);
+    EXPECT(pol->rules.count == 1 && !pol->nr_views && !port_lookup(pol, "1-1", 3));
+    EXPECT_RC(policy_check(pol), 0);
+    policy_free(pol);
+
+    /* a current image has no room for views */
+    img.hdr.version = cpu_to_le16(SNAPSHOT_VERSION);
+    img.hdr.checksum = cpu_to_le64(xxh64(&img.hdr + 1, sizeof(img) - sizeof(img.hdr), 0));
+    pol = policy_clone(NULL);
+    EXPECT_RC(policy_import(pol, &img, sizeof(img)), -EINVAL);
+    policy_free(pol);
+}
+
+static void test_diff(void)
+{
+    struct usbguard_policy *pol = policy_clone(NULL), *copy;
+    struct usbguard_port *port;
+    struct usbguard_view *view;
+    size_t done, accepted, len;
+    unsigned long n;
+    void *img;
+    int rc;
+
+    EXPECT_RC(store(pol, diff_line, diff_text, &done, &accepted), 0);
+    EXPECT(accepted == 13);
+    EXPECT(pol->rules.count == 2 && ruleset_match(&pol->rules, KEY(0x1000, 0x15)));
+    EXPECT(fp_set_match(&pol->fingerprints, 0x0123456789abcdefULL));
+    EXPECT(pol->serials.count == 1 && find(&pol->serials, "SN2"));
+    port = port_lookup(pol, "1-1", 3);
+    EXPECT(port && port->ns == 7 && ruleset_match(&port->rules, KEY(0x2000, 1)));
+    port = port_lookup(pol, "1-1.2", 5);
+    EXPECT(port && ruleset_match(&port->rules, KEY(0x2000, 3)));
+    view = view_lookup(pol, 7);
+    EXPECT(view && view->nr_ports == 1 && ruleset_match(&view->rules, KEY(0x2000, 0x80)));
+    EXPECT(pol->nr_quotas == 2 && pol->grants.count == 1);
+    EXPECT(ruleset_match(&pol->grants.set, KEY(0x3000, 1)));
+    EXPECT_RC(policy_check(pol), 0);
+
+    /* bad lines: unknown view removal, port on a ttl rule, over-long ttl */
+    EXPECT_RC(diff(pol, "-%8 @1-1"), -ENOENT);
+    EXPECT_RC(diff(pol, "%8 @1-1"), -EBUSY);
+    EXPECT_RC(diff(pol, "@1-1 3000 0002 ttl=1h"), -EINVAL);
+    EXPECT_RC(diff(pol, "3000 0002 ttl=31d"), -EINVAL);
+    EXPECT_RC(diff(pol, "-quota 09"), -ENOENT);
+    EXPECT_RC(diff(pol, "-serial SN1"), -ENOENT);
+    EXPECT_RC(diff(pol, "%7 @1-1.2"), 0);
+    EXPECT_RC(diff(pol, "-%7 @1-1.2"), 0);
+    EXPECT(view_lookup(pol, 7) && !port_lookup(pol, "1-1.2", 5)->ns);
+
+    /* the image carries everything but grants and loads back */
+    img = policy_export(pol, &len);
+    EXPECT(img != NULL);
+    copy = policy_clone(NULL);
+    EXPECT_RC(policy_import(copy, img, len), 0);
+    EXPECT(copy->rules.count == pol->rules.count && copy->nr_quotas == 2);
+    EXPECT(copy->serials.count == 1 && copy->fingerprints.count == 1);
+    EXPECT(port_lookup(copy, "1-1", 3) && !copy->grants.count);
+    EXPECT(!copy->nr_views && !port_lookup(copy, "1-1", 3)->ns);
+    EXPECT_RC(policy_check(copy), 0);
+    policy_free(copy);
+
+    /* copies compare equal until something that matters changes */
+    copy = policy_clone(pol);
+    EXPECT(policy_equal(pol, copy));
+    EXPECT_RC(diff(copy, "4000 0001"), 0);
+    EXPECT(!policy_equal(pol, copy) && !policy_equal(copy, pol));
+    EXPECT_RC(diff(copy, "-4000 0001"), 0);
+    EXPECT(policy_equal(pol, copy));
+    EXPECT_RC(diff(copy, "serial SN2"), 0);
+    EXPECT_RC(diff(copy, "quota 08 2"), 0);
+    EXPECT(policy_equal(pol, copy));
+    EXPECT_RC(diff(copy, "quota 08 3"), 0);
+    EXPECT(!policy_equal(pol, copy));
+    policy_free(copy);
+    copy = policy_clone(pol);
+    EXPECT_RC(diff(copy, "@1-1 1000 0009"), 0);
+    EXPECT(!policy_equal(pol, copy));
+    policy_free(copy);
+    copy = policy_clone(pol);
+    copy->grants.items[0].expires++;
+    EXPECT(!policy_equal(pol, copy));
+    policy_free(copy);
+
+    /* a reload carries the grants over into the freshly loaded policy */
+    copy = policy_clone(NULL);
+    EXPECT_RC(grant_list_copy(&copy->grants, &pol->grants), 0);
+    EXPECT(copy->grants.count == 1 && ruleset_match(&copy->grants.set, KEY(0x3000, 1)));
+    EXPECT_RC(policy_check(copy), 0);
+    policy_free(copy);
+
+    /* rules files skip bad lines but fail on the first ENOMEM */
+    copy = policy_clone(NULL);
+    EXPECT_RC(apply_policy_blob(copy, "bogus\n1000 0001\n", 16, "test"), 0);
+    EXPECT(copy->rules.count == 1);
+    shim_fail_nth = 1;
+    EXPECT_RC(apply_policy_blob(copy, "2000 0001\n@1-9 2000 0003\n", 25, "test"), -ENOMEM);
+    shim_fail_nth = 0;
+    policy_free(copy);
+
+    /* a damaged image is rejected before anything is merged */
+    ((u8 *)img)[len - 1] ^= 1;
+    copy = policy_clone(NULL);
+    EXPECT_RC(policy_import(copy, img, len), -EBADMSG);
+    EXPECT(!copy->rules.count && !copy->serials.count);
+    policy_free(copy);
+    free(img);
+
+    /* a clone that runs out of memory part way frees what it copied */
+    for (n = 1; ; n++) {
+        shim_fail_nth = n;
+        copy = policy_clone(pol);
+        shim_fail_nth = 0;
+        if (copy) break;
+    }
+    EXPECT(n > 1);
+    policy_free(copy);
+
+    /* and so does a diff: whatever failed, the tables stay consistent */
+    for (n = 1; n < 64; n++) {
+        copy = policy_clone(NULL);
+        shim_fail_nth = n;
+        rc = store(copy, diff_line, diff_text, &done, &accepted);
+        shim_fail_nth = 0;
+        EXPECT(rc == 0 || rc == -ENOMEM);
+        EXPECT_RC(policy_check(copy), 0);
+        policy_free(copy);
+    }
+    policy_free(pol);
+}
+
+/*
+ * Random adds and removals of ranges and masks on a few VIDs, checked
+ * against a bitmap of every key after each step. A failed update must
+ * leave the table as it was.
+ */
+#define RANDOM_VIDS 4
+#define RANDOM_STEPS 20000
+
+static unsigned long ref_bits[BITS_TO_LONGS(RANDOM_VIDS << 16)];
+
+static void ref_set(u32 key, bool on)
+{
+    if (on)
+        ref_bits[key / BITS_PER_LONG] |= 1UL << (key % BITS_PER_LONG);
+    else
+        ref_bits[key / BITS_PER_LONG] &= ~(1UL << (key % BITS_PER_LONG));
+}
+
+static void test_random(void)
+{
+    struct ruleset set = {0};
+    struct vidpid r;
+    u32 step, key, pid;
+    int rc;
+
+    for (step = 0; step < RANDOM_STEPS; step++) {
+        bool remove = random() % 3 == 0;
+
+        r.vid = random() % RANDOM_VIDS;
+        r.pid = random() & 0xFFFF;
+        r.mask = 0xFFFF;
+        r.pid_hi = r.pid;
+        switch (random() % 3) {
+        case 0:
+            key = r.pid + random() % 64;
+            r.pid_hi = min(key, 0xFFFFU);
+            break;
+        case 1:
+            /* up to 8 random clear bits */
+            for (key = random() % 9; key; key--)
+                r.mask &= ~(1U << (random() % 16));
+            r.pid &= r.mask;
+            r.pid_hi = r.pid;
+            break;
+        }
+
+        rc = ruleset_update(&set, &r, remove);
+        if (rc) {
+            EXPECT(rc == -ENOENT || rc == -ENOSPC);
+        } else {
+            for (pid = r.pid; pid <= 0xFFFF; pid++)
+                if (r.mask == 0xFFFF ? pid <= r.pid_hi : (pid & r.mask) == r.pid)
+                    ref_set(KEY(r.vid, pid), !remove);
+        }
+
+        if (step % 1000 == 0 || step == RANDOM_STEPS - 1) {
+            EXPECT_RC(ruleset_check(&set), 0);
+            for (key = 0; key < RANDOM_VIDS << 16; key++)
+                if (ruleset_match(&set, key) != test_bit(key, ref_bits)) {
+                    EXPECT(!"table differs from reference");
+                    fprintf(stderr, "  step %u key %08x\n", step, key);
+                    break;
+                }
+        }
+    }
+    ruleset_free(&set);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int seed = argc > 1 ? strtoul(argv[1], NULL, 0) : 1;
+
+    srandom(seed);
+    test_trim();
+    test_parse_vidpid();
+    test_parse_fingerprint();
+    test_ranges();
+    test_masks();
+    test_full_table();
+    test_ranges_enomem();
+    test_fingerprints();
+    test_serials();
+    test_store();
+    test_diff();
+    test_old_views();
+    test_random();
+
+    printf("usbguard-test: seed %u, %d checks, %d failed\n", seed, checks, failures);
+    return failures ? 1 : 0;
+}